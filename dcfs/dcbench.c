@@ -0,0 +1,132 @@
+/*
+ * dcbench: mount a dcfs posted in /srv and time it:
+ * the attach, then for each image the time to its
+ * first byte and the rate of the whole read.
+ *
+ *	ephsim -s ephsim; dcfs -l /srv/ephsim -s dcfs
+ *	dcbench /srv/dcfs
+ */
+
+#include <u.h>
+#include <libc.h>
+#include <bio.h>
+
+enum {
+	Bufsize = 8192,
+};
+
+static double
+ms(vlong ns)
+{
+	return ns/1000000.0;
+}
+
+static int
+dircmp(void *a, void *b)
+{
+	return strcmp(((Dir*)a)->name, ((Dir*)b)->name);
+}
+
+static void
+usage(void)
+{
+	fprint(2, "usage: dcbench [-n nimages] [-m mtpt] srvfile\n");
+	exits("usage");
+}
+
+/* what dcfs says about errors and recovering from them */
+static void
+ctlstats(char *mtpt)
+{
+	Biobuf *b;
+	char *name, *l;
+
+	name = smprint("%s/ctl", mtpt);
+	if ((b = Bopen(name, OREAD)) == nil) {
+		free(name);
+		return;
+	}
+	while ((l = Brdline(b, '\n')) != nil) {
+		l[Blinelen(b)-1] = 0;
+		if (strncmp(l, "resyncs", 7) == 0 || strncmp(l, "naks", 4) == 0 ||
+		    strncmp(l, "line", 4) == 0 || strncmp(l, "errors getvar", 13) == 0)
+			print("%s\n", l);
+	}
+	Bterm(b);
+	free(name);
+}
+
+void
+main(int argc, char **argv)
+{
+	char *mtpt, *dir, *name, *buf;
+	int fd, i, n, nd, max;
+	vlong t0, t1, tfirst, ttot, tfirsts, bytes, got;
+	Dir *d;
+
+	mtpt = "/n/dcbench";
+	max = 0;
+	ARGBEGIN{
+	case 'm':
+		mtpt = EARGF(usage());
+		break;
+	case 'n':
+		max = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+	if (argc != 1)
+		usage();
+
+	rfork(RFNAMEG);
+	if ((fd = open(argv[0], ORDWR)) < 0)
+		sysfatal("open %s: %r", argv[0]);
+	t0 = nsec();
+	if (mount(fd, -1, mtpt, MREPL, "") < 0)
+		sysfatal("mount %s: %r", mtpt);
+	print("attach %.1f ms\n", ms(nsec()-t0));
+
+	dir = smprint("%s/pics", mtpt);
+	if ((fd = open(dir, OREAD)) < 0)
+		sysfatal("open %s: %r", dir);
+	nd = dirreadall(fd, &d);
+	close(fd);
+	qsort(d, nd, sizeof d[0], dircmp);
+	if (max > 0 && nd > max)
+		nd = max;
+
+	buf = malloc(Bufsize);
+	bytes = 0;
+	ttot = 0;
+	tfirsts = 0;
+	for (i = 0; i < nd; i++) {
+		name = smprint("%s/%s", dir, d[i].name);
+		t0 = nsec();
+		if ((fd = open(name, OREAD)) < 0)
+			sysfatal("open %s: %r", name);
+		tfirst = 0;
+		got = 0;
+		while ((n = read(fd, buf, Bufsize)) > 0) {
+			if (tfirst == 0)
+				tfirst = nsec()-t0;
+			got += n;
+		}
+		if (n < 0)
+			sysfatal("read %s: %r", name);
+		close(fd);
+		t1 = nsec()-t0;
+		print("%s %lld bytes first %.1f ms total %.1f ms %.0f bytes/s\n",
+			d[i].name, got, ms(tfirst), ms(t1), t1? got*1e9/t1: 0.0);
+		bytes += got;
+		ttot += t1;
+		tfirsts += tfirst;
+		free(name);
+	}
+	if (nd > 0)
+		print("%d images %lld bytes mean first byte %.1f ms sustained %.0f bytes/s\n",
+			nd, bytes, ms(tfirsts/nd), ttot? bytes*1e9/ttot: 0.0);
+	ctlstats(mtpt);
+	unmount(nil, mtpt);
+	exits(nil);
+}
@@ -10,13 +10,19 @@ http://www.caldo.demon.co.uk/plan9/soft/
 The fs part is my doing.  Send the bug reports to me: fst@9netics.com
 The fs has only been tested on my Sanyo VPC-X360.
 
-The eventual goal is to have an fs with this general layout:
+The eventual goal is to have an fs with this general layout,
+under a directory named for each camera's device when there is
+more than one (eia0/ctl, eia0/pics/, eia1/ctl, ...):
 
 	ctl	# for commands to the camera -- eventually
+	pics.tar	# all of pics/, in one read
 	pics/
 		pic01
 		pic02
 		...
+	thumbs/	# the camera's thumbnails of pics/
+		pic01
+		...
 	seqs/
 		seq01
 		seq02
@@ -29,8 +35,9 @@ The eventual goal is to have an fs with this general layout:
 reading ctl should perhaps return the camera
 ID information, etc. commands that can be written
 to ctl should be:
-	snap		- take a snapshot
-	speed xxx	- set port speed
+	snap		- take a snapshot (done; read it from latest)
+	rescan		- pick up pictures taken or deleted since attach (done)
+	speed xxx	- set port speed (done; xxx can be auto)
 	port xxx		- ??? set to a different port. Not sure about this
 	???
 
@@ -49,238 +56,2207 @@ first time it is read, so it works sort of like a cache.
 #include <thread.h>
 #include <9p.h>
 
-#include "eph_io.h"
+#include "eph_io.h"
+
+enum {
+	STACK = 32*1024,	/* eph_ keeps packet buffers on the stack */
+	Tracesize = EPH_NTRACE*80,	/* eph_fmttrace of a full ring */
+};
+
+static long speed = MAX_SPEED;	/* for a -l device without its own; EPH_AUTO probes */
+static int idletime = 60;	/* seconds before an idle session is closed */
+static char *cachedir;		/* where fetched images are kept, if set */
+static char *indexfile;		/* slot, size and time of each image; cachedir/index by default */
+static char *delayfile;		/* the camera's write delays; cachedir/delays by default */
+static char *recfile;		/* where the line's traffic is recorded, if set */
+static int calibrate;		/* find the shortest delays at the next session */
+static int tracedump;		/* trace entries printed on each eph error */
+static vlong memlimit;		/* bytes of image data kept in memory; 0 is no limit */
+static int radepth = 1;		/* images to read ahead of the last one read */
+static vlong rabudget = 8*1024*1024;	/* bytes read ahead and not yet read, per camera */
+
+enum {
+	Qpic,		/* an image */
+	Qtmn,		/* its thumbnail */
+	Qctl,
+	Qtar,		/* every image, as a tar archive */
+	Qlatest,	/* the image taken by the last snap */
+	Qtrace,		/* eph's record of the frames on the line */
+};
+
+/* a read waiting for an image's data; base is where the image starts in the file read */
+typedef struct Wait	Wait;
+struct Wait {
+	Req *r;
+	vlong base;
+};
+
+typedef struct Cam	Cam;
+typedef struct Camfile	Camfile;
+struct Camfile {
+	int type;
+	Cam *cam;
+	char *data;
+	int len;	/* actual length of 'data' */
+	int slot;	/* id to poke into reg 12 */
+	long mtime;	/* creation time from reg 47 */
+	int meta;	/* len and mtime have been read from the camera */
+	File *file;
+	int have;	/* bytes of 'data' received so far */
+	int loading;	/* a fetch is queued or running */
+	int ahead;	/* read ahead and not yet read by a client */
+	long rtime;	/* when a client last read it */
+	int gone;	/* removed from the card and the tree */
+	vlong shot;	/* nsec() at the snap that took it, until it has been read in */
+	int gen;	/* bumped when the slot comes to hold another image */
+	Wait *wait;	/* reads beyond 'have', answered as data arrives */
+	int nwait;
+	Camfile *lprev;	/* lru list of files holding data */
+	Camfile *lnext;
+};
+
+/* what a fid of latest read first, and stays with */
+typedef struct Bound	Bound;
+struct Bound {
+	Camfile *cf;
+	int gen;	/* cf->gen then */
+};
+
+/* a cached image read in by cacheproc, outside filelk */
+typedef struct Load	Load;
+struct Load {
+	Camfile *cf;
+	char *name;
+	int len;	/* what the file must hold to be cf's */
+	long mtime;
+	int class;	/* for the fetch, should it not be there */
+};
+
+typedef struct Attach	Attach;
+struct Attach {
+	Req *r;
+	int pending;	/* cameras still building their trees */
+	int ok;		/* cameras with a tree */
+};
+
+typedef struct Work	Work;
+struct Work {
+	int op;
+	Req *r;		/* Wstat */
+	Attach *at;	/* Wattach */
+	long arg;	/* Wspeed */
+	Camfile *cf;	/* Wfetch */
+	int class;
+	vlong queued;	/* nsec() */
+	Work *next;
+};
+
+enum {
+	Wattach,
+	Wfetch,
+	Wstat,		/* fill in len and mtime for a Tstat */
+	Wprefetch,	/* read-ahead; runs only when no other work is queued */
+	Wsweep,		/* fill in len and mtime of the next unknown image; ditto */
+	Wquit,
+	Wtarmeta,	/* fill in every image's len and mtime for a read or stat of pics.tar */
+	Wrescan,	/* a rescan written to ctl */
+	Wsnap,		/* a snap written to ctl */
+	Wspeed,		/* a speed written to ctl */
+};
+
+/*
+ * work is run a class at a time, oldest first within a class,
+ * and a fetch always runs to the end of its image, so a client
+ * opening one image waits at most for the image being read.
+ * a read of the slot after one a client read in the last
+ * Seqwindow seconds is taken for part of a copy: bulk.
+ */
+enum {
+	Cfg,		/* attach, stat, reads out of sequence */
+	Cbulk,		/* sequential reads */
+	Cbg,		/* read-ahead and sweeping */
+	Nclass,
+
+	Seqwindow = 10,
+};
+
+static char *classname[Nclass] = {
+	[Cfg]	"interactive",
+	[Cbulk]	"bulk",
+	[Cbg]	"background",
+};
+
+/*
+ * one camera: its serial line, its subtree (the root when it is
+ * the only one) and camproc, which does all its eph_ traffic.
+ * the session stays open between requests and belongs to
+ * camproc; filelk protects the rest.  the 9P side queues Work
+ * and pokes kickc.  xfer is the file being fetched, for progress.
+ */
+struct Cam {
+	char *name;	/* last element of the device */
+	char *dir;	/* the subtree, with a trailing slash, or "" */
+	char *device;
+	long speed;
+	char *cachedir;
+	char *indexfile;
+	char *delayfile;
+	char *recfile;
+	int calibrate;
+	eph_iob *iob;
+
+	int camup;
+	long camused;
+	Camfile *xfer;
+
+	Work *workq;
+	Work **worktail;
+	Channel *kickc;
+	Channel *tickc;
+	int treebuilt;
+	Camfile *tar;
+
+	/* snap: reads of latest wait while one is pending */
+	int snapping;
+	Camfile *latest;
+	Req **lwait;
+	int nlwait;
+	vlong shot;		/* of the snap being taken, camproc's */
+	long snapcount;
+	int nsnaps;
+	vlong firstlast, firstsum;	/* shutter to first byte */
+	int nfirst;
+	vlong donelast, donesum;	/* shutter to the whole image */
+	int ndone;
+
+	/* time spent queued, by class */
+	long nwaited[Nclass];
+	vlong waitsum[Nclass];
+	vlong waitmax[Nclass];
+
+	/* images and thumbnails by slot, and the read-ahead state */
+	Camfile **slots;
+	Camfile **tslots;
+	int nslots;
+	int idxdirty;		/* metadata learned since the index was written */
+	int idxerr;		/* the last saveindex failed, and said so */
+	int lastread;
+	int lasttype;		/* of the last file read, Qpic or Qtmn */
+	vlong raused;
+};
+
+/*
+ * filelk protects the Camfile fields above, each Cam's work
+ * queue and slots, and the memory accounting below; it is
+ * never held across serial i/o, so the cameras' camprocs
+ * run their transfers in parallel.
+ */
+static QLock filelk;
+static Cam **cams;
+static int ncams;
+static int nquit;		/* camprocs that have shut down */
+
+/* image buffers in use, most recently read first, all cameras */
+static Camfile *lruhead;
+static Camfile *lrutail;
+static vlong memused;
+
+static void fsattach(Req *);
+static void fsopen(Req *);
+static void fsread(Req *);
+static void fswrite(Req *);
+static void fsdestroyfid(Fid *);
+static void fsflush(Req *);
+static void fsstat(Req *);
+static void promote(Camfile *, int);
+static Work* queuework(Cam*, int, Req*, Camfile*);
+static int loadindex(Cam*);
+static void addslot(Cam*, int);
+static void imgread(Req*, Camfile*, vlong, int);
+static long atospeed(char*);
+static int tarread(Req*, Cam*);
+static vlong tarlen(Cam*);
+static void settarlen(Cam*);
+static void fscleanup(Srv*);
+static void dcfscreatefile(char *, Camfile *, Dir *);
+
+Srv dcfs = {
+	.attach=	fsattach,
+	.open=	fsopen,
+	.read=	fsread,
+	.write=	fswrite,
+	.flush=	fsflush,
+	.stat=	fsstat,
+	.destroyfid=	fsdestroyfid,
+	.end=	fscleanup,
+};
+
+/*
+ * make an entry for every image from the count in reg 10
+ * alone, so attach costs the same however full the card is.
+ * sizes and times are filled in by getmeta, on a stat or
+ * read or by the background sweep.
+ */
+static int
+bldidir(Cam *c)
+{
+	long max;
+	int j;
+
+	if (chatty9p) fprint(2, "%s: getting image count\n", c->name);
+	if (eph_getint(c->iob, 10, &max)) {
+		return 0;
+	}
+
+	if (chatty9p) fprint(2, "%s: image count: %lud\n", c->name, max);
+
+	qlock(&filelk);
+	c->slots = erealloc9p(c->slots, max*sizeof c->slots[0]);
+	memset(c->slots, 0, max*sizeof c->slots[0]);
+	c->tslots = erealloc9p(c->tslots, max*sizeof c->tslots[0]);
+	memset(c->tslots, 0, max*sizeof c->tslots[0]);
+	c->nslots = 0;
+	qunlock(&filelk);
+
+	for (j = 1; j <= max; j++)
+		addslot(c, j);
+	qlock(&filelk);
+	c->nslots = max;	/* only once every slot is filled in */
+	qunlock(&filelk);
+
+	loadindex(c);
+	return 1;
+}
+
+/* the image and thumbnail files for slot j, whose metadata is still to come */
+static void
+addslot(Cam *c, int j)
+{
+	Dir d;
+	char fname[256];
+	Camfile *cf;
+
+	d.length = 0;
+	d.atime = d.mtime = time(0);
+	d.mode = 0444;				/* read only */
+
+	snprint(fname, sizeof fname, "%spics/pic%3.3d.jpg", c->dir, j);
+	cf = emalloc9p(sizeof *cf);
+	cf->cam = c;
+	cf->slot = j;
+
+	if (chatty9p)
+		fprint(2, "creating file %s\n", fname);
+	dcfscreatefile(fname, cf, &d);
+	c->slots[j-1] = cf;
+
+	snprint(fname, sizeof fname, "%sthumbs/pic%3.3d.jpg", c->dir, j);
+	cf = emalloc9p(sizeof *cf);
+	cf->type = Qtmn;
+	cf->cam = c;
+	cf->slot = j;
+	dcfscreatefile(fname, cf, &d);
+	c->tslots[j-1] = cf;
+}
+
+/*
+ * the registers that hold the size and the data of cf's image
+ * or thumbnail in the current frame, and the files of its kind.
+ */
+static int
+sizereg(Camfile *cf)
+{
+	return cf->type == Qtmn? 13: 12;
+}
+
+static int
+datareg(Camfile *cf)
+{
+	return cf->type == Qtmn? REG_TMN: REG_IMG;
+}
+
+static Camfile**
+kindslots(Cam *c, int type)
+{
+	return type == Qtmn? c->tslots: c->slots;
+}
+
+/* read the size (from reg) and, unless mtimep is nil, creation time of the image in slot */
+static int
+querymeta(Cam *c, int slot, int reg, long *lenp, long *mtimep)
+{
+	char *buffer;
+	long bufsize;
+	long res;
+	int i, k;
+	eph_iob *iob = c->iob;
+
+	/* set image index */
+	if (eph_setint(iob, 4, slot) != 0) {
+		return 0;
+	}
+
+	/* get image size */
+	if (eph_getint(iob, reg, lenp) != 0) {
+		if (chatty9p)  fprint(2, "eph_getint failed image size(reg %d), index(%d)\n", reg, slot);
+		return 0;
+	}
+	if (mtimep == nil)
+		return 1;
+
+	/* get image creation time */
+	/* goofyass way this library works, you've got to malloc all buffers */
+	bufsize=32;
+	buffer = emalloc9p(bufsize);
+
+	if (eph_getvar(iob, 47, (char**)&buffer, &bufsize) != 0) {
+		if (chatty9p)  fprint(2, "can't get the image mtime, index(%d)\n", slot);
+		free(buffer);
+		return 0;
+	}
+
+	/* bytes 20-24 are creation time (UNIX format) */
+	if (chatty9p)  fprint(2, "extracting image date/time\n");
+	for (res = 0, i = 20, k = 0; i  < 24; i++, k += 8) {
+		res += (long) buffer[i] << k;
+	}
+	free(buffer);
+
+	if (res == -1L) res = time(0);
+	*mtimep = res;
+	return 1;
+}
+
+static void
+setmeta(Camfile *cf, long len, long mtime)
+{
+	File *f;
+
+	qlock(&filelk);
+	cf->len = len;
+	cf->mtime = mtime;
+	cf->meta = 1;
+	cf->cam->idxdirty = 1;
+	qunlock(&filelk);
+
+	f = cf->file;
+	wlock(f);
+	f->length = len;
+	f->atime = f->mtime = mtime;
+	wunlock(f);
+}
+
+static int
+getmeta(Camfile *cf)
+{
+	Camfile *o;
+	long len, mtime;
+	int known;
+
+	/* an image and its thumbnail have the one time: ask for it once */
+	known = 0;
+	qlock(&filelk);
+	if (cf->slot <= cf->cam->nslots) {
+		o = kindslots(cf->cam, cf->type == Qtmn? Qpic: Qtmn)[cf->slot-1];
+		if (o != nil && o->meta) {
+			known = 1;
+			mtime = o->mtime;
+		}
+	}
+	qunlock(&filelk);
+	if (! querymeta(cf->cam, cf->slot, sizereg(cf), &len, known? nil: &mtime))
+		return 0;
+	setmeta(cf, len, mtime);
+	return 1;
+}
+
+typedef struct Index	Index;
+struct Index {
+	long len;
+	long mtime;
+};
+
+/* does slot still hold what want says? */
+static int
+idxmatch(Cam *c, int slot, Index *want, int *err)
+{
+	long len, mtime;
+
+	if (! querymeta(c, slot, 12, &len, &mtime)) {
+		*err = 1;
+		return 0;
+	}
+	if (len == want->len && mtime == want->mtime) {
+		setmeta(c->slots[slot-1], len, mtime);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * how many of the n slots in slot[], in order, still hold the
+ * images want[] says they did.  deleting an image shifts those
+ * after it down, so once one has changed all after it have: the
+ * last is tried, then the first, then a binary search finds the
+ * boundary.  *err is set if the camera couldn't be asked.
+ */
+static int
+lastmatch(Cam *c, int *slot, Index *want, int n, int *err)
+{
+	int lo, hi, mid;
+
+	*err = 0;
+	if (n > 0 && idxmatch(c, slot[n-1], &want[n-1], err))
+		return n;
+	if (n < 2 || *err || ! idxmatch(c, slot[0], &want[0], err))
+		return 0;
+	lo = 1;
+	hi = n;
+	while (hi-lo > 1 && ! *err) {
+		mid = (lo+hi)/2;
+		if (idxmatch(c, slot[mid-1], &want[mid-1], err))
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * take what we can from the index of an earlier run.
+ * pictures are only ever added at the end or deleted, which
+ * shifts the ones after, so the index is good up to some slot:
+ * check the last slot both know about and, failing that,
+ * binary search for the last one that still matches.
+ * slots past it are left to getmeta.
+ */
+static int
+loadindex(Cam *c)
+{
+	Biobuf *b;
+	char *l, *f[3];
+	Index *idx;
+	int *slot, i, n, lo, err;
+
+	if (c->indexfile == nil || (b = Bopen(c->indexfile, OREAD)) == nil)
+		return 0;
+	idx = emalloc9p(c->nslots*sizeof idx[0]);
+	n = 0;
+	while ((l = Brdline(b, '\n')) != nil) {
+		l[Blinelen(b)-1] = 0;
+		if (tokenize(l, f, nelem(f)) != 3)
+			continue;
+		i = atoi(f[0]);
+		if (i != n+1 || i > c->nslots)
+			break;
+		idx[n].len = atol(f[1]);
+		idx[n].mtime = strtoul(f[2], nil, 10);
+		n++;
+	}
+	Bterm(b);
+
+	slot = emalloc9p((n+1)*sizeof slot[0]);
+	for (i = 0; i < n; i++)
+		slot[i] = i+1;
+	lo = lastmatch(c, slot, idx, n, &err);
+	free(slot);
+	for (i = 1; i <= lo; i++)
+		if (! c->slots[i-1]->meta)
+			setmeta(c->slots[i-1], idx[i-1].len, idx[i-1].mtime);
+	if (chatty9p) fprint(2, "%s: index: %d entries, first %d still good\n", c->name, n, lo);
+	free(idx);
+	c->idxdirty = lo < n;
+	return lo;
+}
+
+/* once per run of failures, so retrying each idle tick isn't noisy */
+static void
+idxfail(Cam *c, char *what)
+{
+	if (! c->idxerr || chatty9p)
+		fprint(2, "%s: saveindex: %s %s.tmp: %r\n", c->name, what, c->indexfile);
+	c->idxerr = 1;
+}
+
+/*
+ * write the index of everything known, up to the first unknown
+ * slot.  a rename can't replace a file on Plan 9, so the old
+ * index is removed first; a crash between the two loses it,
+ * and the next attach asks the camera instead.
+ */
+static void
+saveindex(Cam *c)
+{
+	char *tmp, *p;
+	Biobuf *b;
+	Dir d;
+	int i, fd, err;
+
+	if (c->indexfile == nil)
+		return;
+	tmp = smprint("%s.tmp", c->indexfile);
+	if ((fd = create(tmp, OWRITE, 0644)) < 0) {
+		idxfail(c, "create");
+		free(tmp);
+		return;
+	}
+	b = emalloc9p(sizeof *b);
+	Binit(b, fd, OWRITE);
+	qlock(&filelk);
+	for (i = 0; i < c->nslots && c->slots[i]->meta; i++)
+		Bprint(b, "%d %d %lud\n", c->slots[i]->slot, c->slots[i]->len, c->slots[i]->mtime);
+	c->idxdirty = 0;
+	qunlock(&filelk);
+	err = Bterm(b) < 0;
+	free(b);
+	close(fd);
+	if (err) {
+		idxfail(c, "write");
+		goto bad;
+	}
+	nulldir(&d);
+	p = strrchr(c->indexfile, '/');
+	d.name = p? p+1: c->indexfile;
+	remove(c->indexfile);
+	if (dirwstat(tmp, &d) < 0) {
+		idxfail(c, "rename");
+		goto bad;
+	}
+	c->idxerr = 0;
+	free(tmp);
+	return;
+bad:
+	remove(tmp);
+	free(tmp);
+	qlock(&filelk);
+	c->idxdirty = 1;	/* try again at the next idle tick */
+	qunlock(&filelk);
+}
+
+static void
+lruunlink(Camfile *cf)
+{
+	if (cf->lprev)
+		cf->lprev->lnext = cf->lnext;
+	else
+		lruhead = cf->lnext;
+	if (cf->lnext)
+		cf->lnext->lprev = cf->lprev;
+	else
+		lrutail = cf->lprev;
+	cf->lprev = cf->lnext = nil;
+}
+
+static void
+lrutouch(Camfile *cf)
+{
+	if (lruhead == cf)
+		return;
+	if (cf->lprev || cf->lnext || lrutail == cf)
+		lruunlink(cf);
+	cf->lnext = lruhead;
+	if (lruhead)
+		lruhead->lprev = cf;
+	lruhead = cf;
+	if (lrutail == nil)
+		lrutail = cf;
+}
+
+/* called with filelk held */
+static void
+imgfree(Camfile *cf)
+{
+	if (cf->data == nil)
+		return;
+	lruunlink(cf);
+	memused -= cf->len;
+	if (cf->ahead) {
+		cf->ahead = 0;
+		cf->cam->raused -= cf->len;
+	}
+	free(cf->data);
+	cf->data = nil;
+	cf->have = 0;
+}
+
+/*
+ * give cf buf, first dropping the least recently read
+ * images that nobody is fetching or waiting on until the
+ * total fits in memlimit.  called with filelk held.
+ */
+static void
+imgput(Camfile *cf, char *buf)
+{
+	Camfile *v, *p;
+
+	for (v = lrutail; v && memlimit > 0 && memused+cf->len > memlimit; v = p) {
+		p = v->lprev;
+		if (v->loading || v->nwait)
+			continue;
+		if (chatty9p) fprint(2, "evicting %s image %d\n", v->cam->name, v->slot);
+		imgfree(v);
+	}
+	cf->data = buf;
+	cf->have = 0;
+	memused += cf->len;
+	lrutouch(cf);
+}
+
+static void
+imgalloc(Camfile *cf)
+{
+	imgput(cf, emalloc9p(cf->len));
+}
+
+/*
+ * answer r, for which cf starts at base, from whatever part
+ * of cf has arrived.
+ * returns 0 if none of the requested range is there yet.
+ * called with filelk held.
+ *
+ * the reply points into cf->data rather than being copied
+ * to r's own buffer: respond packs it into the connection's
+ * before returning, and lib9p frees only the buffer it gave
+ * r, never ofcall.data.  the image data can't be evicted or
+ * freed in the meantime because that too needs filelk.
+ */
+static int
+readimg(Req *r, Camfile *cf, vlong base)
+{
+	vlong offset;
+	long count;
+
+	offset = r->ifcall.offset - base;
+	count = r->ifcall.count;
+
+	if(! cf->meta)
+		return 0;
+	if(offset >= cf->len){
+		r->ofcall.count = 0;
+		respond(r, nil);
+		return 1;
+	}
+	if(offset >= cf->have)
+		return 0;
+
+	if(offset+count >= cf->have)
+		count = cf->have - offset;
+
+	r->ofcall.data = cf->data+offset;
+	r->ofcall.count = count;
+	respond(r, nil);
+	return 1;
+}
+
+/* answer the waiting reads that the data now covers */
+static void
+wakeimg(Camfile *cf)
+{
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < cf->nwait; i++)
+		if (! readimg(cf->wait[i].r, cf, cf->wait[i].base))
+			cf->wait[n++] = cf->wait[i];
+	cf->nwait = n;
+}
+
+static void
+failimg(Camfile *cf, char *err)
+{
+	int i;
+
+	for (i = 0; i < cf->nwait; i++)
+		respond(cf->wait[i].r, err);
+	cf->nwait = 0;
+}
+
+/*
+ * eph_getvarbuf progress callback: each packet has landed
+ * in the file being fetched; hand it to any read waiting.
+ * it runs in the camera's camproc, whose procdata is the Cam.
+ */
+static void
+progress(long n)
+{
+	Cam *c = *procdata();
+	Camfile *cf;
+
+	if (c == nil || (cf = c->xfer) == nil)
+		return;
+	qlock(&filelk);
+	if (cf->shot && cf->have == 0 && n > 0) {
+		c->firstlast = nsec() - cf->shot;
+		c->firstsum += c->firstlast;
+		c->nfirst++;
+	}
+	cf->have = n;
+	if (cf->shot && n == cf->len) {
+		c->donelast = nsec() - cf->shot;
+		c->donesum += c->donelast;
+		c->ndone++;
+		cf->shot = 0;
+	}
+	wakeimg(cf);
+	qunlock(&filelk);
+}
+
+static int
+fetchimg(Camfile *cf)
+{
+	int err;
+	eph_iob *iob = cf->cam->iob;
+
+	assert(cf->data);
+
+	if (err = eph_setint(iob, 4, (long) cf->slot)) {
+		if (chatty9p) fprint(2, "eph_setint(reg=4,slot=%d) returns %d\n", cf->slot, err);
+		return 0;
+	}
+
+	/* a retried transfer starts over; readers already have the same bytes */
+	qlock(&filelk);
+	cf->have = 0;
+	qunlock(&filelk);
+
+	if (err = eph_getvarbuf(iob, datareg(cf), cf->data, cf->len)) {
+		if (chatty9p) fprint(2, "eph_getvarbuf(reg=%d) returns %d\n", datareg(cf), err);
+		return 0;
+	}
+	if (cf->have != cf->len) {
+		if (chatty9p) fprint(2, "image %d: got %d bytes, expected %d\n", cf->slot, cf->have, cf->len);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * the disk cache keeps one file per image, named by what
+ * identifies it on the card: slot, length and creation time,
+ * with a tmn prefix for thumbnails.
+ */
+static char*
+cachename(Camfile *cf, char *suffix)
+{
+	return smprint("%s/%s%d-%d-%lud.jpg%s", cf->cam->cachedir, cf->type == Qtmn? "tmn": "",
+		cf->slot, cf->len, cf->mtime, suffix);
+}
+
+/* len bytes of the cache file name into buf */
+static int
+cacheread(char *name, char *buf, int len)
+{
+	Dir *d;
+	int fd, ok;
+
+	if ((fd = open(name, OREAD)) < 0)
+		return 0;
+	ok = (d = dirfstat(fd)) != nil && d->length == len && readn(fd, buf, len) == len;
+	free(d);
+	close(fd);
+	return ok;
+}
+
+/*
+ * in camproc, without filelk: cf->data is allocated and
+ * cf->loading keeps it from being evicted.
+ */
+static int
+cacheload(Camfile *cf)
+{
+	char *name;
+	int ok;
+
+	if (cf->cam->cachedir == nil)
+		return 0;
+	name = cachename(cf, "");
+	ok = cacheread(name, cf->data, cf->len);
+	free(name);
+	if (chatty9p && ok) fprint(2, "%s image %d from cache\n", cf->cam->name, cf->slot);
+	return ok;
+}
+
+/*
+ * a read of an image not in memory, in a proc of its own so
+ * the disk is read without filelk held and without waiting
+ * behind camproc's transfer.  the buffer is installed only if
+ * cf still is the image the file was named for; if it isn't,
+ * or the file isn't there, cf is fetched from the camera.
+ */
+static void
+cacheproc(void *a)
+{
+	Load *l = a;
+	Camfile *cf = l->cf;
+	Work *w;
+	char *buf;
+	int ok;
+
+	threadsetname("dcfscache");
+	buf = emalloc9p(l->len);
+	ok = cacheread(l->name, buf, l->len);
+	qlock(&filelk);
+	if (cf->gone || ! cf->loading || cf->data != nil)
+		;	/* dropped, forgotten or loaded meanwhile */
+	else if (ok && cf->meta && cf->len == l->len && cf->mtime == l->mtime) {
+		if (chatty9p) fprint(2, "%s image %d from cache\n", cf->cam->name, cf->slot);
+		imgput(cf, buf);
+		buf = nil;
+		cf->have = cf->len;
+		cf->loading = 0;
+		wakeimg(cf);
+	} else {
+		w = queuework(cf->cam, Wfetch, nil, cf);
+		w->class = l->class;
+	}
+	qunlock(&filelk);
+	free(buf);
+	closefile(cf->file);
+	free(l->name);
+	free(l);
+}
+
+/* write under a temporary name and rename, so a crash leaves no partial image */
+static void
+cachestore(Camfile *cf)
+{
+	char *tmp, *name, *p;
+	Dir d;
+	int fd;
+
+	if (cf->cam->cachedir == nil)
+		return;
+	tmp = cachename(cf, ".tmp");
+	name = cachename(cf, "");
+	/* writable until it is complete, so a crash's leftover can be recreated */
+	if ((fd = create(tmp, OWRITE, 0644)) < 0) {
+		if (chatty9p) fprint(2, "cachestore: %r\n");
+		goto out;
+	}
+	if (write(fd, cf->data, cf->len) != cf->len) {
+		if (chatty9p) fprint(2, "cachestore %s: %r\n", tmp);
+		close(fd);
+		remove(tmp);
+		goto out;
+	}
+	close(fd);
+	nulldir(&d);
+	p = strrchr(name, '/');
+	d.name = p? p+1: name;
+	d.mode = 0444;
+	remove(name);		/* one that didn't load; a rename won't replace it */
+	if (dirwstat(tmp, &d) < 0) {
+		if (chatty9p) fprint(2, "cachestore rename %s: %r\n", tmp);
+		remove(tmp);
+	}
+out:
+	free(tmp);
+	free(name);
+}
+
+static void
+ecreatefile(File *root, char *name, char *user, ulong mode, void *aux)
+{
+	File *f;
+	f = createfile(root, name, user, mode, aux);
+	if(f == nil)
+		sysfatal("creating %s", name);
+}
+
+/*
+ * the write delays eph has settled on for this camera,
+ * so the next run starts from them.
+ */
+static void
+loaddelays(Cam *c)
+{
+	char buf[128], *f[DL_N];
+	int fd, n, i;
+	eph_iob *iob = c->iob;
+
+	if (c->delayfile == nil || (fd = open(c->delayfile, OREAD)) < 0)
+		return;
+	n = read(fd, buf, sizeof buf-1);
+	close(fd);
+	if (n <= 0)
+		return;
+	buf[n] = 0;
+	if (tokenize(buf, f, DL_N) != DL_N)
+		return;
+	for (i = 0; i < DL_N; i++)
+		iob->delay[i] = atol(f[i]);
+}
+
+static void
+savedelays(Cam *c)
+{
+	int fd;
+	eph_iob *iob = c->iob;
+
+	if (c->delayfile == nil)
+		return;
+	if ((fd = create(c->delayfile, OWRITE, 0644)) < 0) {
+		if (chatty9p) fprint(2, "savedelays: %r\n");
+		return;
+	}
+	fprint(fd, "%ld %ld %ld %ld\n", iob->delay[DL_PKT], iob->delay[DL_CMD],
+		iob->delay[DL_PRM], iob->delay[DL_BYTE]);
+	close(fd);
+}
+
+static int
+caminit(Cam *c)
+{
+	eph_iob *iob = c->iob;
+	long ret;
+
+	if (eph_open(iob, c->device, c->speed) != 0) {
+		if (chatty9p) fprint(2, "%s: eph_open failed\n", c->name);
+		return 0;
+	}
+
+	if (eph_getint(iob, 1, &ret) != 0) {
+		if (chatty9p) fprint(2, "%s: probe failed\n", c->name);
+		eph_close(iob, 1);	/* turn off */
+		return 0;
+	}
+
+	if (c->calibrate) {
+		c->calibrate = 0;
+		if (eph_calibrate(iob) < 0 && chatty9p)
+			fprint(2, "%s: calibration didn't settle\n", c->name);
+		savedelays(c);
+	}
+	return 1;
+}
+
+static void
+camfini(Cam *c)
+{
+	eph_close(c->iob, 1);	/* turn the camera off and close */
+}
+
+/*
+ * run fn inside the open session, opening it if needed.
+ * if fn fails the line may have dropped: put the camera
+ * back to its default speed, reconnect and try once more.
+ * with -b auto, eph_tune follows the line between calls.
+ * called from camproc.
+ */
+static int
+camdo(Cam *c, int (*fn)(void*), void *a)
+{
+	int try;
+
+	for (try = 0; try < 2; try++) {
+		if (! c->camup) {
+			if (! caminit(c))
+				continue;
+			c->camup = 1;
+		}
+		c->camused = time(0);
+		if (fn(a)) {
+			c->camused = time(0);
+			switch (eph_tune(c->iob)) {
+			case 1:
+				if (chatty9p) fprint(2, "%s: line now %ld\n", c->name, c->iob->speed);
+				break;
+			case -1:
+				if (chatty9p) fprint(2, "%s: speed change failed\n", c->name);
+				eph_close(c->iob, 0);
+				c->camup = 0;
+				return 1;
+			}
+			if (idletime == 0) {
+				camfini(c);
+				c->camup = 0;
+			}
+			return 1;
+		}
+		if (chatty9p) fprint(2, "%s: camera session lost, reconnecting\n", c->name);
+		/* with -b auto, come back slower; that doesn't use up a try */
+		if (c->camup && eph_stepdown(c->iob)) {
+			if (chatty9p) fprint(2, "%s: next session no faster than %ld\n", c->name, c->iob->speedcap);
+			try--;
+		}
+		eph_close(c->iob, 0);
+		c->camup = 0;
+	}
+	return 0;
+}
+
+static int
+dobldidir(void *a)
+{
+	return bldidir(a);
+}
+
+static int
+dofetchimg(void *a)
+{
+	return fetchimg(a);
+}
+
+static int
+dogetmeta(void *a)
+{
+	return getmeta(a);
+}
+
+/*
+ * build c's tree if it isn't yet; the last camera to finish
+ * answers the attach, which fails only if none has a tree.
+ */
+static void
+doattach(Cam *c, Attach *at)
+{
+	Req *r;
+	int ok;
+
+	ok = c->treebuilt || camdo(c, dobldidir, c);
+	qlock(&filelk);
+	if (ok && ! c->treebuilt) {
+		c->iob->debug = chatty9p;
+		c->treebuilt = 1;
+		queuework(c, Wsweep, nil, nil);
+	}
+	if (ok)
+		at->ok++;
+	if (--at->pending == 0) {
+		r = at->r;
+		if (at->ok) {
+			r->fid->qid = dcfs.tree->root->qid;
+			r->ofcall.qid = r->fid->qid;
+			respond(r, nil);
+		} else
+			respond(r, "can't get image list");
+		free(at);
+	}
+	qunlock(&filelk);
+}
+
+/*
+ * bring cf into memory: its size and time if not yet known,
+ * then the disk cache or the camera.  ahead says whether this
+ * is read-ahead, to be charged to rabudget.
+ */
+static void
+dofetch(Camfile *cf, int ahead)
+{
+	Cam *c = cf->cam;
+	int aok, need, ok;
+
+	aok = 1;
+	if (! cf->meta)
+		aok = camdo(c, dogetmeta, cf);
+
+	need = 0;
+	if (aok) {
+		qlock(&filelk);
+		if (cf->data == nil) {
+			imgalloc(cf);
+			if (ahead) {
+				cf->ahead = 1;
+				c->raused += cf->len;
+			}
+			qunlock(&filelk);
+			ok = cacheload(cf);
+			qlock(&filelk);
+			if (ok)
+				cf->have = cf->len;
+		}
+		need = cf->have < cf->len;
+		qunlock(&filelk);
+	}
+
+	if (aok && need) {
+		c->xfer = cf;
+		aok = camdo(c, dofetchimg, cf);
+		c->xfer = nil;
+
+		if (aok)
+			cachestore(cf);
+	}
+
+	qlock(&filelk);
+	cf->loading = 0;
+	if (aok)
+		wakeimg(cf);
+	else {
+		failimg(cf, "fetchimg failed");
+		imgfree(cf);
+		cf->shot = 0;
+	}
+	qunlock(&filelk);
+}
+
+static void
+dostat(Req *r)
+{
+	Camfile *cf;
+
+	cf = r->fid->file->aux;
+	if (! cf->meta && ! camdo(cf->cam, dogetmeta, cf)) {
+		respond(r, "can't get image information");
+		return;
+	}
+	r->d.length = cf->len;
+	r->d.atime = r->d.mtime = cf->mtime;
+	respond(r, nil);
+}
+
+/* everything pics.tar's headers need, in one session */
+static void
+dotarmeta(Cam *c, Req *r)
+{
+	Camfile *cf;
+	int i, n;
+
+	qlock(&filelk);
+	n = c->nslots;
+	qunlock(&filelk);
+	for (i = 0; i < n; i++) {
+		cf = c->slots[i];
+		if (! cf->meta && ! camdo(c, dogetmeta, cf)) {
+			respond(r, "can't get image information");
+			return;
+		}
+	}
+	settarlen(c);
+	qlock(&filelk);
+	if (r->ifcall.type == Tstat) {
+		r->d.length = tarlen(c);
+		respond(r, nil);
+	} else
+		tarread(r, c);
+	qunlock(&filelk);
+}
+
+/* add slots up to max, for images taken since the tree was built */
+static void
+growslots(Cam *c, long max)
+{
+	Camfile **sl;
+	int i, n;
+
+	n = c->nslots;
+	if (max <= n)
+		return;
+	qlock(&filelk);
+	sl = emalloc9p(max*sizeof sl[0]);
+	memmove(sl, c->slots, n*sizeof sl[0]);
+	free(c->slots);
+	c->slots = sl;
+	sl = emalloc9p(max*sizeof sl[0]);
+	memmove(sl, c->tslots, n*sizeof sl[0]);
+	free(c->tslots);
+	c->tslots = sl;
+	qunlock(&filelk);
+	for (i = n+1; i <= max; i++)
+		addslot(c, i);
+	qlock(&filelk);
+	c->nslots = max;
+	qunlock(&filelk);
+}
+
+/* take cf's fetches off the queue.  called with filelk held */
+static void
+unqueue(Camfile *cf)
+{
+	Cam *c = cf->cam;
+	Work **l, *w;
+
+	for (l = &c->workq; (w = *l) != nil; )
+		if (w->cf == cf) {
+			*l = w->next;
+			if (c->worktail == &w->next)
+				c->worktail = l;
+			free(w);
+		} else
+			l = &w->next;
+}
+
+/*
+ * the image has left the card: answer its readers, drop its
+ * data and take it out of the tree.  fids still open on it
+ * keep the Camfile until they are clunked.
+ */
+static void
+dropfile(Camfile *cf)
+{
+	qlock(&filelk);
+	unqueue(cf);
+	if (cf->cam->latest == cf)
+		cf->cam->latest = nil;
+	cf->gone = 1;
+	cf->loading = 0;
+	failimg(cf, "image removed");
+	imgfree(cf);
+	qunlock(&filelk);
+	incref(cf->file);	/* removefile uses up a reference */
+	removefile(cf->file);
+}
+
+/*
+ * slot now holds another image: forget what we knew of the old
+ * one.  its readers are failed rather than handed the new one's
+ * bytes after the old one's.
+ */
+static void
+forget(Camfile *cf)
+{
+	qlock(&filelk);
+	if (cf->meta) {
+		unqueue(cf);
+		if (cf->cam->latest == cf)
+			cf->cam->latest = nil;
+		cf->gen++;	/* fids of latest bound to it let go */
+		cf->loading = 0;
+		failimg(cf, "image changed");
+		imgfree(cf);
+		cf->meta = 0;
+		cf->cam->idxdirty = 1;
+	}
+	qunlock(&filelk);
+}
+
+
+/*
+ * bring the tree up to date with the card after more shots or
+ * deletions.  as in loadindex, a deletion shifts every image
+ * after it down a slot, so a known image still in its slot
+ * vouches for all before it: check the last one we know and,
+ * failing that, binary search for the last one still in place.
+ * everything we knew after that is forgotten; slots past the
+ * old count are added and slots past the new one removed.
+ * images that haven't moved keep their data.
+ */
+static int
+rescan(void *a)
+{
+	Cam *c = a;
+	long max;
+	Index *want;
+	int *known, nk, n, i, j, good, err;
+
+	if (eph_getint(c->iob, 10, &max))
+		return 0;
+	n = c->nslots < max? c->nslots: max;
+	if (chatty9p) fprint(2, "%s: rescan: %d images, was %d\n", c->name, (int)max, c->nslots);
+
+	known = emalloc9p((n+1)*sizeof known[0]);
+	want = emalloc9p((n+1)*sizeof want[0]);
+	nk = 0;
+	qlock(&filelk);
+	for (i = 1; i <= n; i++)
+		if (c->slots[i-1]->meta) {
+			want[nk].len = c->slots[i-1]->len;
+			want[nk].mtime = c->slots[i-1]->mtime;
+			known[nk++] = i;
+		}
+	qunlock(&filelk);
+
+	good = lastmatch(c, known, want, nk, &err);
+	good = good > 0? known[good-1]: 0;
+	free(known);
+	free(want);
+	if (err)
+		return 0;
+	if (chatty9p) fprint(2, "%s: rescan: first %d unchanged\n", c->name, good);
+
+	for (i = good+1; i <= n; i++) {
+		forget(c->slots[i-1]);
+		forget(c->tslots[i-1]);
+	}
+	qlock(&filelk);
+	j = c->nslots;
+	if (max < j)
+		c->nslots = max;	/* before they can be freed */
+	qunlock(&filelk);
+	for (i = j; i > max; i--) {
+		dropfile(c->slots[i-1]);
+		dropfile(c->tslots[i-1]);
+	}
+	growslots(c, max);
+	qlock(&filelk);
+	c->idxdirty = 1;
+	qunlock(&filelk);
+	return 1;
+}
+
+/*
+ * fire the shutter, once however often camdo tries, and see
+ * which slot the picture went to: the last.
+ */
+static int
+snap(void *a)
+{
+	Cam *c = a;
+	char zero = 0;
+	vlong t;
+
+	if (c->shot == 0) {
+		t = nsec();
+		if (eph_action(c->iob, 2, &zero, 1) != 0)
+			return 0;
+		c->shot = t;
+	}
+	return eph_getint(c->iob, 10, &c->snapcount) == 0;
+}
+
+/* called with filelk held */
+static void
+bindlatest(Req *r, Camfile *cf)
+{
+	Bound *b;
+
+	/* two reads on one fid can both have waited for the snap */
+	if ((b = r->fid->aux) != nil) {
+		if (b->cf == cf && b->gen == cf->gen)
+			return;
+		closefile(b->cf->file);
+		free(b);
+	}
+	b = emalloc9p(sizeof *b);
+	b->cf = cf;
+	b->gen = cf->gen;
+	incref(cf->file);	/* let go by fsdestroyfid */
+	r->fid->aux = b;
+}
+
+/*
+ * take a picture, answer the ctl write, and read the picture
+ * in at once for the readers of latest.  progress notes how
+ * long after the shutter its first byte and the whole arrived,
+ * whichever fetch reads it.
+ */
+static void
+dosnap(Cam *c, Req *r)
+{
+	Camfile *cf;
+	Req **w;
+	int i, nw, ok, fetch;
+
+	c->shot = 0;
+	ok = camdo(c, snap, c) && c->snapcount > 0;
+	if (ok && c->snapcount <= c->nslots) {
+		/* pictures were deleted since the tree was built: the slot is reused */
+		forget(c->slots[c->snapcount-1]);
+		forget(c->tslots[c->snapcount-1]);
+	} else if (ok)
+		growslots(c, c->snapcount);
+	qlock(&filelk);
+	c->snapping--;
+	if (! ok || c->snapcount > c->nslots) {
+		if (c->snapping == 0) {
+			for (i = 0; i < c->nlwait; i++)
+				respond(c->lwait[i], "snap failed");
+			c->nlwait = 0;
+		}
+		qunlock(&filelk);
+		respond(r, "snap failed");
+		return;
+	}
+	cf = c->slots[c->snapcount-1];
+	cf->shot = c->shot;
+	c->latest = cf;
+	c->nsnaps++;
+	c->idxdirty = 1;
+	fetch = ! cf->loading;
+	cf->loading = 1;	/* fetched below, not queued */
+	w = c->lwait;
+	nw = c->nlwait;
+	c->lwait = nil;
+	c->nlwait = 0;
+	for (i = 0; i < nw; i++) {
+		bindlatest(w[i], cf);
+		imgread(w[i], cf, 0, Cfg);
+	}
+	qunlock(&filelk);
+	free(w);
+	respond(r, nil);
+	settarlen(c);
+
+	if (fetch)
+		dofetch(cf, 0);
+}
+
+/* for this session, if one is open, and the next */
+static void
+dospeed(Cam *c, Req *r, long speed)
+{
+	if (c->camup && eph_setspeed(c->iob, speed) != 0) {
+		eph_close(c->iob, 0);	/* the line is in doubt: start afresh */
+		c->camup = 0;
+		respond(r, "speed change failed");
+		return;
+	}
+	c->speed = speed;
+	c->iob->speedcap = 0;	/* eph_setspeed's doing, when the line is open */
+	respond(r, nil);
+}
+
+static int
+dorescan1(void *a)
+{
+	return rescan(a);
+}
+
+static void
+dorescan(Cam *c, Req *r)
+{
+	Work *w;
+	int ok;
+
+	if (c->treebuilt)
+		ok = camdo(c, dorescan1, c);
+	else if (ok = camdo(c, dobldidir, c)) {
+		qlock(&filelk);
+		c->iob->debug = chatty9p;
+		c->treebuilt = 1;
+		qunlock(&filelk);
+	}
+	if (! ok) {
+		respond(r, "rescan failed");
+		return;
+	}
+	qlock(&filelk);
+	for (w = c->workq; w != nil; w = w->next)
+		if (w->op == Wsweep)
+			break;
+	if (w == nil)
+		queuework(c, Wsweep, nil, nil);
+	qunlock(&filelk);
+	settarlen(c);
+	respond(r, nil);
+}
+
+/*
+ * fill in one image that nobody has asked about yet and queue
+ * the next, so client work can get in between.
+ */
+static void
+dosweep(Cam *c)
+{
+	Camfile *cf;
+	int i;
+
+	cf = nil;
+	qlock(&filelk);
+	for (i = 0; i < c->nslots; i++)
+		if (c->slots[i] && ! c->slots[i]->meta && ! c->slots[i]->loading) {
+			cf = c->slots[i];
+			break;
+		}
+	qunlock(&filelk);
+	if (cf == nil) {
+		settarlen(c);
+		return;
+	}
+	if (! camdo(c, dogetmeta, cf))
+		return;
+	qlock(&filelk);
+	queuework(c, Wsweep, nil, nil);
+	qunlock(&filelk);
+}
+
+/*
+ * the oldest work of the most urgent class queued, noting how
+ * long it waited.  called with filelk held.
+ */
+static Work*
+nextwork(Cam *c)
+{
+	Work **l, **best, *w;
+	vlong t;
+
+	best = nil;
+	for (l = &c->workq; (w = *l) != nil; l = &w->next)
+		if (best == nil || w->class < (*best)->class)
+			best = l;
+	if (best == nil)
+		return nil;
+	w = *best;
+	*best = w->next;
+	if (c->worktail == &w->next)
+		c->worktail = best;
+
+	t = nsec() - w->queued;
+	c->nwaited[w->class]++;
+	c->waitsum[w->class] += t;
+	if (t > c->waitmax[w->class])
+		c->waitmax[w->class] = t;
+	return w;
+}
 
-static long speed = MAX_SPEED;
-static char *device = "/dev/eia0";
+/*
+ * with the line idle, start fetching the next image (or thumbnail)
+ * after the last one a client read, up to radepth images and rabudget
+ * bytes not yet read.
+ */
+static void
+readahead(Cam *c)
+{
+	Camfile **sl, *cf;
+	int i;
+
+	qlock(&filelk);
+	sl = kindslots(c, c->lasttype);
+	for (i = c->lastread+1; c->workq == nil && i <= c->lastread+radepth && i <= c->nslots; i++) {
+		cf = sl[i-1];
+		if (cf == nil || cf->data || cf->loading)
+			continue;
+		if (cf->meta && c->raused+cf->len > rabudget)
+			break;
+		if (chatty9p) fprint(2, "%s: reading ahead image %d\n", c->name, cf->slot);
+		cf->loading = 1;
+		queuework(c, Wprefetch, nil, cf);
+	}
+	qunlock(&filelk);
+}
 
-typedef struct Camfile	Camfile;
-struct Camfile {
-	char *data;
-	int len;	/* actual length of 'data' */
-	int slot;	/* id to poke into reg 12 */
-};
+/* called with filelk held */
+static Work*
+queuework(Cam *c, int op, Req *r, Camfile *cf)
+{
+	Work *w;
+
+	w = emalloc9p(sizeof *w);
+	w->op = op;
+	w->r = r;
+	w->at = nil;
+	w->cf = cf;
+	w->class = op == Wprefetch || op == Wsweep? Cbg: Cfg;
+	w->queued = nsec();
+	w->next = nil;
+	if (op == Wquit) {
+		if ((w->next = c->workq) == nil)
+			c->worktail = &w->next;
+		c->workq = w;
+	} else {
+		*c->worktail = w;
+		c->worktail = &w->next;
+	}
+	nbsendul(c->kickc, 1);
+	return w;
+}
 
-static void fsattach(Req *);
-static void fsread(Req *);
-static void fscleanup(Srv*);
-static void dcfscreatefile(char *, Camfile *, Dir *);
+static void
+tickproc(void*)
+{
+	int i;
 
-Srv dcfs = {
-	.attach=	fsattach,
-	.read=	fsread,
-	.end=	fscleanup,
-};
+	for (;;) {
+		sleep(1000);
+		for (i = 0; i < ncams; i++)
+			nbsendul(cams[i]->tickc, 0);
+	}
+}
 
+/* a camera line that is a pipe (ephsim, ephreplay) may close: let eph see a write error */
 static int
-bldidir(void)
+pipenote(void*, char *msg)
 {
-	Dir d;
-	char fname[256];
-	Tm *tm;
-	Camfile *c;
-	char *buffer;
-	long bufsize;
-	long res, max;
-	register int i, j, k;
-	eph_iob *iob = (eph_iob *) dcfs.aux;
+	return strcmp(msg, "sys: write on closed pipe") == 0;
+}
 
-	if (chatty9p) fprint(2, "getting image count\n");
-	if (eph_getint(iob, 10, &max)) {
-		return 0;
+static void
+camproc(void *a)
+{
+	Cam *c = a;
+	Work *w;
+	ulong x;
+	int last;
+	Alt alts[] = {
+		{c->kickc, &x, CHANRCV},
+		{c->tickc, &x, CHANRCV},
+		{nil, nil, CHANEND},
+	};
+
+	threadsetname("camproc %s", c->name);
+	*procdata() = c;
+	threadnotify(pipenote, 1);	/* eph writes the line from this proc */
+	for (;;) {
+		switch (alt(alts)) {
+		case 0:
+			for (;;) {
+				qlock(&filelk);
+				w = nextwork(c);
+				qunlock(&filelk);
+				if (w == nil)
+					break;
+				switch (w->op) {
+				case Wattach:
+					doattach(c, w->at);
+					break;
+				case Wfetch:
+				case Wprefetch:
+					dofetch(w->cf, w->op == Wprefetch);
+					break;
+				case Wstat:
+					dostat(w->r);
+					break;
+				case Wsweep:
+					dosweep(c);
+					break;
+				case Wtarmeta:
+					dotarmeta(c, w->r);
+					break;
+				case Wrescan:
+					dorescan(c, w->r);
+					break;
+				case Wsnap:
+					dosnap(c, w->r);
+					break;
+				case Wspeed:
+					dospeed(c, w->r, w->arg);
+					break;
+				case Wquit:
+					if (c->idxdirty)
+						saveindex(c);
+					savedelays(c);
+					if (c->camup)
+						camfini(c);
+					c->camup = 0;
+					eph_free(c->iob);
+					qlock(&filelk);
+					last = ++nquit == ncams;
+					qunlock(&filelk);
+					if (last)
+						threadexitsall(nil);
+					threadexits(nil);
+				}
+				free(w);
+			}
+			if (radepth > 0)
+				readahead(c);
+			break;
+		case 1:
+			if (c->idxdirty)
+				saveindex(c);
+			if (c->camup && idletime > 0 && time(0) - c->camused >= idletime) {
+				if (chatty9p) fprint(2, "%s: closing idle camera session\n", c->name);
+				camfini(c);
+				c->camup = 0;
+			}
+			break;
+		}
 	}
+}
 
-	if (chatty9p) fprint(2, "image count: %lud\n", max);
+static void
+fsattach(Req *r)
+{
+	char *spec;
+	Attach *at;
+	Work *w;
+	int i;
 
-	for (j = 1; j <= max; j++) {
-		/* set image index */
-		if (eph_setint(iob, 4, j) != 0) {
-			return 0;
-		}
+	spec = r->ifcall.aname;		/* special args to mount? */
+	if (spec && spec[0]) {			/* we don't expect any */
+		respond(r, "invalid attach specifier");
+		return;
+	}
 
-		/* get image size */
-		if (eph_getint(iob,12, &res) != 0) {
-			if (chatty9p)  fprint(2, "eph_getint failed image size(reg 12), index(%d)\n", j);
-			return 0;
+	qlock(&filelk);
+	at = nil;
+	for (i = 0; i < ncams; i++)
+		if (! cams[i]->treebuilt) {
+			if (at == nil) {
+				at = emalloc9p(sizeof *at);
+				at->r = r;
+			}
+			at->pending++;
+			w = queuework(cams[i], Wattach, nil, nil);
+			w->at = at;
 		}
+	if (at == nil) {
+		r->fid->qid = dcfs.tree->root->qid;
+		r->ofcall.qid = r->fid->qid;
+		respond(r, nil);
+	} else
+		at->ok = ncams - at->pending;
+	qunlock(&filelk);
+}
 
-		d.length = (int) res;		/* Dir:length */
+static void
+ctlread(Req *r, Cam *c)
+{
+	char *buf, *p, *e;
+	int i, known, queued;
+	Work *w;
+
+	buf = emalloc9p(4096);
+	p = buf;
+	e = buf+4096;
+	qlock(&filelk);
+	for (known = i = 0; i < c->nslots; i++)
+		if (c->slots[i] && c->slots[i]->meta)
+			known++;
+	for (queued = 0, w = c->workq; w; w = w->next)
+		queued++;
+	if (c->speed == EPH_AUTO)
+		p = seprint(p, e, "device %s\nspeed auto\nsession %s\n", c->device, c->camup? "open": "closed");
+	else
+		p = seprint(p, e, "device %s\nspeed %ld\nsession %s\n", c->device, c->speed, c->camup? "open": "closed");
+	p = seprint(p, e, "images %d\nknown %d\nqueued %d\n", c->nslots, known, queued);
+	p = seprint(p, e, "memory %lld %lld\nreadahead %lld %lld\n", memused, memlimit, c->raused, rabudget);
+	p = seprint(p, e, "snaps %d\n", c->nsnaps);
+	if (c->nfirst)
+		p = seprint(p, e, "snap first %lldms avg %lldms\n", c->firstlast/1000000, c->firstsum/c->nfirst/1000000);
+	if (c->ndone)
+		p = seprint(p, e, "snap done %lldms avg %lldms\n", c->donelast/1000000, c->donesum/c->ndone/1000000);
+	for (i = 0; i < Nclass; i++)
+		p = seprint(p, e, "wait %s %ld avg %lldms max %lldms\n", classname[i], c->nwaited[i],
+			c->nwaited[i]? c->waitsum[i]/c->nwaited[i]/1000000: 0, c->waitmax[i]/1000000);
+	qunlock(&filelk);
+	eph_fmtstats(c->iob, p, e);
+	readstr(r, buf);
+	free(buf);
+	respond(r, nil);
+}
 
-		/* get image creation time */
-		/* goofyass way this library works, you've got to malloc all buffers */
-		bufsize=32;
-		buffer = emalloc9p(bufsize);
+/* is cf the next in a run of reads, or something a client just opened? */
+static int
+readclass(Camfile *cf)
+{
+	Camfile *p;
 
-		if (eph_getvar(iob, 47, (char**)&buffer, &bufsize) != 0) {
-			sysfatal("can't get the image mtime");
-		}
+	if (cf->slot < 2 || (p = kindslots(cf->cam, cf->type)[cf->slot-2]) == nil)
+		return Cfg;
+	if (p->rtime && time(0) - p->rtime < Seqwindow)
+		return Cbulk;
+	return Cfg;
+}
 
-		/* bytes 20-24 are creation time (UNIX format) */
-		if (chatty9p)  fprint(2, "extracting image date/time\n");
-		for (res = 0, i = 20, k = 0; i  < 24; i++, k += 8) {
-			res += (long) buffer[i] << k;
-		}
-		free(buffer);
+/*
+ * answer r from cf, which starts at base in the file read,
+ * queueing a fetch of class if it isn't all here.
+ * called with filelk held.
+ */
+static void
+imgread(Req *r, Camfile *cf, vlong base, int class)
+{
+	Cam *c = cf->cam;
+	Work *w;
+	Load *l;
 
-		if (res == -1L) res = time(0);
-		d.atime = d.mtime = (int) res;		/* Dir:mtime */
-		d.mode = 0444;				/* read only */
+	if (! cf->meta || ! cf->data)
+		;	/* dofetch or cacheproc allocates */
+	else
+		lrutouch(cf);
+	if (cf->ahead) {
+		cf->ahead = 0;
+		c->raused -= cf->len;
+	}
+	cf->rtime = time(0);
+	if (! cf->loading && cf->meta && ! cf->data && c->cachedir) {
+		cf->loading = 1;
+		l = emalloc9p(sizeof *l);
+		l->cf = cf;
+		l->name = cachename(cf, "");
+		l->len = cf->len;
+		l->mtime = cf->mtime;
+		l->class = class;
+		incref(cf->file);	/* let go by cacheproc */
+		proccreate(cacheproc, l, STACK);
+	} else if (! cf->loading && (! cf->meta || cf->have < cf->len)) {
+		cf->loading = 1;
+		w = queuework(c, Wfetch, nil, cf);
+		w->class = class;
+	} else if (cf->loading)
+		promote(cf, class);
+	if (cf->slot != c->lastread || cf->type != c->lasttype) {
+		c->lastread = cf->slot;
+		c->lasttype = cf->type;
+		nbsendul(c->kickc, 1);	/* look at read-ahead again */
+	}
+	if (! readimg(r, cf, base)) {
+		cf->wait = erealloc9p(cf->wait, (cf->nwait+1)*sizeof cf->wait[0]);
+		cf->wait[cf->nwait].r = r;
+		cf->wait[cf->nwait].base = base;
+		cf->nwait++;
+	}
+}
 
-		tm = gmtime(res);
+/*
+ * pics.tar holds, for each image in slot order, a ustar
+ * header and the image padded to a whole block, and then
+ * two empty blocks.  the headers come from the metadata.
+ */
+enum {
+	Tblock = 512,
+};
 
-		sprint(fname, "pics/%4.4d%2.2d%2.2d_%3.3d.jpg",
-			1900+tm->year, tm->mon+1, tm->mday, j);
-		c = emalloc9p(sizeof *c);
-		c->len = d.length;
-		c->slot = j;
+static vlong
+tarmember(Camfile *cf)
+{
+	return Tblock + (cf->len+Tblock-1)/Tblock*Tblock;
+}
 
-		if (chatty9p)
-			fprint(2, "creating file %s\n", fname);
-		dcfscreatefile(fname, c, &d);
-	}
+/* called with filelk held */
+static int
+tarknown(Cam *c)
+{
+	int i;
 
+	for (i = 0; i < c->nslots; i++)
+		if (c->slots[i] == nil || ! c->slots[i]->meta)
+			return 0;
 	return 1;
 }
 
-static int
-fetchimg(Camfile *cf)
+/* called with filelk held and every image's metadata known */
+static vlong
+tarlen(Cam *c)
 {
-	off_t got;
-	int err;
-	eph_iob *iob = (eph_iob *) dcfs.aux;
+	vlong n;
+	int i;
 
-	assert(cf->len > 0);
-	assert(cf->data);
+	n = 2*Tblock;
+	for (i = 0; i < c->nslots; i++)
+		n += tarmember(c->slots[i]);
+	return n;
+}
 
-	if (err = eph_setint(iob, 4, (long) cf->slot)) {
-		if (chatty9p) fprint(2, "eph_setint(reg=4,slot=%d) returns %d\n", cf->slot, err);
-		return 0;
-	}
+static void
+settarlen(Cam *c)
+{
+	vlong n;
+	File *f;
 
-	got = cf->len;
-	if (err = eph_getvar(iob, 14, &cf->data, &got)) {
-		if (chatty9p) fprint(2, "eph_getvar(reg=14) returns %d\n", err);
-		free(cf->data);
-		cf->data = 0;
-		return 0;
+	qlock(&filelk);
+	if (! tarknown(c) || c->tar == nil) {
+		qunlock(&filelk);
+		return;
 	}
-	assert(got == cf->len);
+	n = tarlen(c);
+	qunlock(&filelk);
+	f = c->tar->file;
+	wlock(f);
+	f->length = n;
+	wunlock(f);
+}
 
-	return 1;
+static void
+tarheader(Camfile *cf, char *h)
+{
+	int i;
+	ulong sum;
+
+	memset(h, 0, Tblock);
+	snprint(h, 100, "pics/pic%3.3d.jpg", cf->slot);
+	snprint(h+100, 8, "%07o", 0444);
+	snprint(h+108, 8, "%07o", 0);
+	snprint(h+116, 8, "%07o", 0);
+	snprint(h+124, 12, "%011lo", (ulong)cf->len);
+	snprint(h+136, 12, "%011lo", (ulong)cf->mtime);
+	memset(h+148, ' ', 8);
+	h[156] = '0';
+	memmove(h+257, "ustar", 6);
+	memmove(h+263, "00", 2);
+	strcpy(h+265, "dcfs");
+	strcpy(h+297, "dcfs");
+	sum = 0;
+	for (i = 0; i < Tblock; i++)
+		sum += (uchar)h[i];
+	snprint(h+148, 8, "%06lo", sum);	/* the NUL, then the space already there */
 }
 
+/* a zero-filled or header part of pics.tar: at most to lim */
 static void
-ecreatefile(File *root, char *name, char *user, ulong mode, void *aux)
+tarfill(Req *r, char *src, vlong lim)
 {
-	File *f;
-	f = createfile(root, name, user, mode, aux);
-	if(f == nil)
-		sysfatal("creating %s", name);
+	long n;
+
+	n = r->ifcall.count;
+	if (r->ifcall.offset + n > lim)
+		n = lim - r->ifcall.offset;
+	if (n < 0)
+		n = 0;
+	if (src)
+		memmove(r->ofcall.data, src, n);
+	else
+		memset(r->ofcall.data, 0, n);
+	r->ofcall.count = n;
+	respond(r, nil);
 }
 
+/*
+ * answer a read of pics.tar, the images' parts from imgread,
+ * so they are fetched as the reader gets to them and read-ahead
+ * keeps the line busy.  returns 0 if some image's size isn't
+ * known.  called with filelk held.
+ */
 static int
-caminit(void)
+tarread(Req *r, Cam *c)
 {
-	eph_iob *iob = (eph_iob *) dcfs.aux;
-	long ret;
-
-	if (eph_open(iob, device, speed) != 0) {
-		if (chatty9p) fprint(2, "eph_open failed\n");
-		return 0;
-	}
+	char h[Tblock];
+	vlong off, base;
+	Camfile *cf;
+	int i;
 
-	if (eph_getint(iob, 1, &ret) != 0) {
-		if (chatty9p) fprint(2, "probe failed\n");
-		eph_close(iob, 1);	/* turn off */
+	if (! tarknown(c))
 		return 0;
+	off = r->ifcall.offset;
+	base = 0;
+	cf = nil;
+	for (i = 0; i < c->nslots; i++) {
+		cf = c->slots[i];
+		if (off < base + tarmember(cf))
+			break;
+		base += tarmember(cf);
 	}
+	if (i == c->nslots)
+		tarfill(r, nil, base + 2*Tblock);
+	else if (off < base + Tblock) {
+		tarheader(cf, h);
+		tarfill(r, h + (off-base), base + Tblock);
+	} else if (off >= base + Tblock + cf->len)
+		tarfill(r, nil, base + tarmember(cf));
+	else
+		imgread(r, cf, base + Tblock, Cbulk);
 	return 1;
 }
 
+/*
+ * trace is copied at open, so a reader sees one consistent
+ * listing however many reads it takes.  camproc may be adding
+ * to the ring meanwhile: at worst an entry comes out torn.
+ */
 static void
-camfini(void)
+fsopen(Req *r)
 {
-	eph_close((eph_iob*) dcfs.aux, 1);	/* turn the camera off and close */
+	Camfile *cf;
+	char *s;
+
+	cf = r->fid->file->aux;
+	if (cf && cf->type == Qtrace) {
+		s = emalloc9p(Tracesize);
+		eph_fmttrace(cf->cam->iob, s, s+Tracesize, 0);
+		r->fid->aux = s;
+	}
+	respond(r, nil);
 }
 
 static void
-fsattach(Req *r)
+fsread(Req *r)
 {
-	char *spec;
-	eph_iob *iob;
+	Camfile *cf;
+	Cam *c;
+	Work *w;
+	Bound *b;
 
-	spec = r->ifcall.aname;		/* special args to mount? */
-	if (spec && spec[0]) {			/* we don't expect any */
-		respond(r, "invalid attach specifier");
+	cf = r->fid->file->aux;
+	c = cf->cam;
+	switch (cf->type) {
+	case Qctl:
+		ctlread(r, c);
 		return;
-	}
-
-	if (! caminit()) {
-		respond(r, "can't initialize camera");
+	case Qtrace:
+		readstr(r, r->fid->aux);
+		respond(r, nil);
+		return;
+	case Qtar:
+		qlock(&filelk);
+		if (! tarread(r, c)) {
+			w = queuework(c, Wtarmeta, r, nil);
+			w->class = Cbulk;
+		}
+		qunlock(&filelk);
+		return;
+	case Qlatest:
+		/*
+		 * a fid stays with the image it first read.  a first
+		 * read waits only for a snap already written to ctl,
+		 * and with none pending or taken finds latest empty.
+		 */
+		qlock(&filelk);
+		if ((b = r->fid->aux) != nil) {
+			if (b->cf->gone || b->cf->gen != b->gen)
+				respond(r, "image removed");
+			else
+				imgread(r, b->cf, 0, Cfg);
+		} else if (c->snapping) {
+			c->lwait = erealloc9p(c->lwait, (c->nlwait+1)*sizeof c->lwait[0]);
+			c->lwait[c->nlwait++] = r;
+		} else if (c->latest == nil) {
+			r->ofcall.count = 0;
+			respond(r, nil);
+		} else {
+			bindlatest(r, c->latest);
+			imgread(r, c->latest, 0, Cfg);
+		}
+		qunlock(&filelk);
 		return;
 	}
 
-	if (bldidir()) {
-		iob = (eph_iob *) dcfs.aux;
-		iob->debug = chatty9p;
-		r->fid->qid = dcfs.tree->root->qid;
-		r->ofcall.qid = r->fid->qid;
-		respond(r, nil);
-	}
+	qlock(&filelk);
+	if (cf->gone)
+		respond(r, "image removed");
 	else
-		respond(r, "can't get image list");
-
-	camfini();
+		imgread(r, cf, 0, readclass(cf));
+	qunlock(&filelk);
 }
 
+/* commands written to ctl */
 static void
-fsread(Req *r)
+fswrite(Req *r)
 {
 	Camfile *cf;
-	vlong offset;
-	long count;
+	Cam *c;
+	Work *w;
+	char *buf, *f[4];
+	int nf;
 
 	cf = r->fid->file->aux;
-	offset = r->ifcall.offset;
-	count = r->ifcall.count;
+	if (cf == nil || cf->type != Qctl) {
+		respond(r, "permission denied");
+		return;
+	}
+	c = cf->cam;
+	buf = emalloc9p(r->ifcall.count+1);
+	memmove(buf, r->ifcall.data, r->ifcall.count);
+	buf[r->ifcall.count] = 0;
+	nf = tokenize(buf, f, nelem(f));
+	r->ofcall.count = r->ifcall.count;
+	if (nf == 1 && strcmp(f[0], "rescan") == 0) {
+		qlock(&filelk);
+		queuework(c, Wrescan, r, nil);
+		qunlock(&filelk);
+	} else if (nf == 2 && strcmp(f[0], "speed") == 0 && atospeed(f[1]) != 0) {
+		qlock(&filelk);
+		w = queuework(c, Wspeed, r, nil);
+		w->arg = atospeed(f[1]);
+		qunlock(&filelk);
+	} else if (nf == 1 && strcmp(f[0], "snap") == 0) {
+		qlock(&filelk);
+		c->snapping++;
+		queuework(c, Wsnap, r, nil);
+		qunlock(&filelk);
+	} else
+		respond(r, "bad ctl message");
+	free(buf);
+}
 
-	if (! cf->data) {
-		int aok;
+/* a client wants an image already queued: make it at least as urgent as class */
+static void
+promote(Camfile *cf, int class)
+{
+	Work *w;
 
-		if (! caminit()) {
-			respond(r, "can't initialize camera");
-			return;
+	for (w = cf->cam->workq; w != nil; w = w->next)
+		if ((w->op == Wprefetch || w->op == Wfetch) && w->cf == cf) {
+			w->op = Wfetch;
+			if (class < w->class)
+				w->class = class;
 		}
+}
 
-		cf->data = emalloc9p(cf->len);
+static void
+fsstat(Req *r)
+{
+	Camfile *cf;
+	Bound *b;
 
-		aok = fetchimg(cf);
-		camfini();
+	cf = r->fid->file->aux;
+	qlock(&filelk);
+	if (cf && cf->gone)
+		respond(r, "image removed");
+	else if (cf && (cf->type == Qpic || cf->type == Qtmn) && ! cf->meta)
+		queuework(cf->cam, Wstat, r, nil);
+	else if (cf && cf->type == Qtar && ! tarknown(cf->cam))
+		queuework(cf->cam, Wtarmeta, r, nil);
+	else {
+		if (cf && cf->type == Qtar)
+			r->d.length = tarlen(cf->cam);
+		if (cf && cf->type == Qlatest && (b = r->fid->aux) != nil)
+			r->d.length = b->cf->len;
+		else if (cf && cf->type == Qlatest && cf->cam->latest)
+			r->d.length = cf->cam->latest->len;
+		respond(r, nil);
+	}
+	qunlock(&filelk);
+}
 
-		if (! aok) {
-			respond(r, "fetchimg failed");
-			return;
+/* called with filelk held */
+static int
+unwait(Camfile *cf, Req *o)
+{
+	int i;
+
+	for (i = 0; i < cf->nwait; i++)
+		if (cf->wait[i].r == o) {
+			memmove(cf->wait+i, cf->wait+i+1, (cf->nwait-i-1)*sizeof cf->wait[0]);
+			cf->nwait--;
+			respond(o, "interrupted");
+			return 1;
 		}
-	}
+	return 0;
+}
 
-	if(offset >= cf->len){
-		r->ofcall.count = 0;
-		respond(r, nil);
-		return;
+static void
+fsflush(Req *r)
+{
+	Req *o;
+	Camfile *cf;
+	Cam *c;
+	int i;
+
+	o = r->oldreq;
+	if (o->ifcall.type == Tread && (cf = o->fid->file->aux) != nil) {
+		qlock(&filelk);
+		c = cf->cam;
+		if (cf->type == Qpic || cf->type == Qtmn)
+			unwait(cf, o);
+		else if (cf->type == Qtar) {
+			for (i = 0; i < c->nslots; i++)
+				if (c->slots[i] && unwait(c->slots[i], o))
+					break;
+		} else if (cf->type == Qlatest && o->fid->aux)
+			unwait(((Bound*)o->fid->aux)->cf, o);
+		else if (cf->type == Qlatest) {
+			for (i = 0; i < c->nlwait; i++)
+				if (c->lwait[i] == o) {
+					memmove(c->lwait+i, c->lwait+i+1, (c->nlwait-i-1)*sizeof c->lwait[0]);
+					c->nlwait--;
+					respond(o, "interrupted");
+					break;
+				}
+		}
+		qunlock(&filelk);
 	}
+	respond(r, nil);
+}
 
-	if(offset+count >= cf->len)
-		count = cf->len - offset;
+static void
+fscleanup(Srv*)
+{
+	int i;
 
-	memmove(r->ofcall.data, cf->data+offset, count);
-	r->ofcall.count = count;
-	respond(r, nil);
+	/* each camproc switches its camera off and exits; the last exits all */
+	qlock(&filelk);
+	for (i = 0; i < ncams; i++)
+		queuework(cams[i], Wquit, nil, nil);
+	qunlock(&filelk);
 }
 
 static void
-fscleanup(Srv *srv)
+fsdestroyfid(Fid *fid)
 {
-	if (srv->aux) eph_free((eph_iob *) srv->aux);
+	Camfile *cf;
+	Bound *b;
+
+	if (fid->aux == nil)
+		return;
+	if (fid->file && (cf = fid->file->aux) != nil && cf->type == Qtrace)
+		free(fid->aux);
+	else {
+		b = fid->aux;
+		closefile(b->cf->file);
+		free(b);
+	}
 }
 
 static void
@@ -292,7 +2268,10 @@ fsdestroyfile(File *f)
 
 	cf = f->aux;
 	if (cf) {
-		if (cf->data) free(cf->data);
+		qlock(&filelk);
+		imgfree(cf);
+		qunlock(&filelk);
+		free(cf->wait);
 		free(cf);
 	}
 }
@@ -341,32 +2320,157 @@ dcfscreatefile(char *name, Camfile *photo, Dir *d)
 	/* f->gid = estrdup9p(d->gid); */
 	f->gid = estrdup9p("dcfs");
 	f->aux = photo;
+	photo->file = f;
 	f->mtime = d->mtime;
 	f->length = d->length;
 	decref(f);
 }
 
+/* a byte count with an optional k, m or g suffix */
+static vlong
+atosize(char *s)
+{
+	vlong n;
+	char *p;
+
+	n = strtoll(s, &p, 0);
+	switch (*p) {
+	case 'g':
+	case 'G':
+		n *= 1024;
+	case 'm':
+	case 'M':
+		n *= 1024;
+	case 'k':
+	case 'K':
+		n *= 1024;
+	}
+	return n;
+}
+
+/* a bit rate eph knows, or auto; 0 if it is neither */
+static long
+atospeed(char *s)
+{
+	char *q;
+	long n;
+
+	if (strcmp(s, "auto") == 0)
+		return EPH_AUTO;
+	n = strtol(s, &q, 10);
+	if (n <= 0 || *q != 0 || ! eph_validspeed(n))
+		return 0;
+	return n;
+}
+
+/* a device, or device:speed */
+static Cam*
+newcam(char *arg)
+{
+	Cam *c;
+	char *p;
+
+	c = emalloc9p(sizeof *c);
+	c->device = estrdup9p(arg);
+	c->speed = speed;
+	if ((p = strrchr(c->device, ':')) != nil && (p[1] >= '0' && p[1] <= '9' || strcmp(p+1, "auto") == 0)) {
+		if ((c->speed = atospeed(p+1)) == 0)
+			sysfatal("%s: bad bitrate", arg);
+		*p = 0;
+	}
+	p = strrchr(c->device, '/');
+	c->name = p? p+1: c->device;
+	c->dir = "";
+	c->calibrate = calibrate;
+	c->worktail = &c->workq;
+	c->iob = eph_new(nil, progress, nil, 0);
+	if (c->iob == nil)
+		sysfatal("eph_new failed");
+	c->iob->tracedump = tracedump;
+	c->kickc = chancreate(sizeof(ulong), 1);
+	c->tickc = chancreate(sizeof(ulong), 1);
+	return c;
+}
+
+static void
+mkcachedir(char *dir)
+{
+	int fd;
+
+	if (dir == nil || access(dir, AEXIST) == 0)
+		return;
+	if ((fd = create(dir, OREAD, DMDIR|0775)) < 0)
+		sysfatal("creating %s: %r", dir);
+	close(fd);
+}
+
+/* c's files, in the root or a directory of its own */
+static void
+mkcamtree(Cam *c)
+{
+	File *d, *f, *p;
+	Camfile *ctl, *l, *t;
+
+	d = dcfs.tree->root;
+	if (c->dir[0]) {
+		d = createfile(d, c->name, "dcfs", DMDIR|0555, nil);
+		if (d == nil)
+			sysfatal("creating %s", c->name);
+	}
+
+	if ((p = createfile(d, "pics", "dcfs", DMDIR|0555, nil)) == nil)
+		sysfatal("creating pics");
+	ecreatefile(d, "thumbs", "dcfs", DMDIR|0555, nil);
+
+	closefile(p);
+
+	ctl = emalloc9p(sizeof *ctl);
+	ctl->type = Qctl;
+	ctl->cam = c;
+	ecreatefile(d, "ctl", "dcfs", 0666, ctl);
+
+	/* not in pics: a copy of every picture there must not wait for a snap */
+	l = emalloc9p(sizeof *l);
+	l->type = Qlatest;
+	l->cam = c;
+	ecreatefile(d, "latest", "dcfs", 0444, l);
+
+	t = emalloc9p(sizeof *t);
+	t->type = Qtrace;
+	t->cam = c;
+	ecreatefile(d, "trace", "dcfs", 0444, t);
+
+	c->tar = emalloc9p(sizeof *c->tar);
+	c->tar->type = Qtar;
+	c->tar->cam = c;
+	if ((f = createfile(d, "pics.tar", "dcfs", 0444, c->tar)) == nil)
+		sysfatal("creating pics.tar");
+	c->tar->file = f;
+	closefile(f);
+
+	/* later when I figure out how to get these out of the beast */
+	ecreatefile(d, "seqs", "dcfs", DMDIR|0555, nil);
+	ecreatefile(d, "clips", "dcfs", DMDIR|0555, nil);
+	if (c->dir[0])
+		closefile(d);
+}
+
 void
 usage(void)
 {
-	fprint(2, "usage: dcfs [-D] [-s srvname] [-m mtpt] [-b bitrate] [-l device]\n");
+	fprint(2, "usage: dcfs [-D] [-s srvname] [-m mtpt] [-b bitrate|auto] [-l device[:bitrate]]... [-i idlesecs] [-c cachedir] [-x indexfile] [-C] [-p delayfile] [-M maxmem] [-a depth] [-A abytes] [-T ntrace] [-r recfile]\n");
 	exits("usage");
 }
 
 void
-main(int argc, char **argv)
+threadmain(int argc, char **argv)
 {
 	char *srvname = nil;
 	char *mtpt = nil;
-
-	if (! (dcfs.tree = alloctree(nil, nil, DMDIR|0555, fsdestroyfile)))
-		sysfatal("creating tree");
-
-	ecreatefile(dcfs.tree->root, "pics", "dcfs", DMDIR|0555, nil);
-
-	/* later when I figure out how to get these out of the beast */
-	ecreatefile(dcfs.tree->root, "seqs", "dcfs", DMDIR|0555, nil);
-	ecreatefile(dcfs.tree->root, "clips", "dcfs", DMDIR|0555, nil);
+	char **devs = nil;
+	int ndevs = 0;
+	Cam *c;
+	int i, j, fd;
 
 	ARGBEGIN{
 	case 'D':
@@ -376,14 +2480,46 @@ main(int argc, char **argv)
 		srvname = EARGF(usage());
 		break;
 	case 'l':
-		device=ARGF();
+		devs = erealloc9p(devs, (ndevs+1)*sizeof devs[0]);
+		devs[ndevs++] = EARGF(usage());
 		break;
 	case 'b':
-		speed=atol(ARGF());
+		if ((speed = atospeed(EARGF(usage()))) == 0)
+			usage();
 		break;
 	case 'm':
 		mtpt = EARGF(usage());
 		break;
+	case 'i':
+		idletime = atoi(EARGF(usage()));
+		break;
+	case 'c':
+		cachedir = EARGF(usage());
+		break;
+	case 'x':
+		indexfile = EARGF(usage());
+		break;
+	case 'C':
+		calibrate = 1;
+		break;
+	case 'p':
+		delayfile = EARGF(usage());
+		break;
+	case 'M':
+		memlimit = atosize(EARGF(usage()));
+		break;
+	case 'a':
+		radepth = atoi(EARGF(usage()));
+		break;
+	case 'A':
+		rabudget = atosize(EARGF(usage()));
+		break;
+	case 'T':
+		tracedump = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		recfile = EARGF(usage());
+		break;
 	default:
 		usage();
 	}ARGEND;
@@ -396,12 +2532,60 @@ main(int argc, char **argv)
 	if(chatty9p)
 		fprint(2, "dcfs.nopipe %d srvname %s mtpt %s\n", dcfs.nopipe, srvname, mtpt);
 
-	dcfs.aux = (void*) eph_new(nil, nil, nil,  0);
-	if (! dcfs.aux) {
-		if (chatty9p) fprint(2, "eph_new failed\n");
-		sysfatal("eph_new failed");
+	if (! (dcfs.tree = alloctree(nil, nil, DMDIR|0555, fsdestroyfile)))
+		sysfatal("creating tree");
+
+	if (ndevs == 0) {
+		devs = emalloc9p(sizeof devs[0]);
+		devs[ndevs++] = "/dev/eia0";
+	}
+	mkcachedir(cachedir);
+
+	/*
+	 * one camera keeps the root and the files named by -c, -x,
+	 * -p and -r; with more, each gets a directory of its own
+	 * under each of them, or a suffix for -x, -p and -r.
+	 */
+	cams = emalloc9p(ndevs*sizeof cams[0]);
+	for (i = 0; i < ndevs; i++) {
+		c = newcam(devs[i]);
+		if (ndevs == 1) {
+			c->cachedir = cachedir;
+			c->indexfile = indexfile;
+			c->delayfile = delayfile;
+			c->recfile = recfile;
+		} else {
+			for (j = 0; j < i; j++)
+				if (strcmp(cams[j]->name, c->name) == 0)
+					sysfatal("two cameras named %s", c->name);
+			c->dir = smprint("%s/", c->name);
+			if (cachedir)
+				c->cachedir = smprint("%s/%s", cachedir, c->name);
+			if (indexfile)
+				c->indexfile = smprint("%s.%s", indexfile, c->name);
+			if (delayfile)
+				c->delayfile = smprint("%s.%s", delayfile, c->name);
+			if (recfile)
+				c->recfile = smprint("%s.%s", recfile, c->name);
+		}
+		if (c->indexfile == nil && c->cachedir != nil)
+			c->indexfile = smprint("%s/index", c->cachedir);
+		if (c->delayfile == nil && c->cachedir != nil)
+			c->delayfile = smprint("%s/delays", c->cachedir);
+		mkcachedir(c->cachedir);
+		loaddelays(c);
+		if (c->recfile != nil)
+			if ((fd = create(c->recfile, OWRITE, 0644)) < 0 || eph_record(c->iob, fd) < 0)
+				sysfatal("recording to %s: %r", c->recfile);
+		mkcamtree(c);
+		cams[ncams++] = c;
 	}
+	free(devs);
+
+	for (i = 0; i < ncams; i++)
+		proccreate(camproc, cams[i], STACK);
+	proccreate(tickproc, nil, STACK);
 
-	postmountsrv(&dcfs, srvname, mtpt, MREPL|MCREATE);
-	exits(0);
+	threadpostmountsrv(&dcfs, srvname, mtpt, MREPL|MCREATE);
+	threadexits(nil);
 }
@@ -14,6 +14,7 @@
 #include <u.h>
 #include <libc.h>
 #include <bio.h>
+#include <thread.h>
 #include "eph_io.h"
 
 #define RETRIES              5
@@ -27,7 +28,9 @@
 #define CMDTIMEOUT    15000000L
 
 /* Bruce and others say that adding 1ms delay before all writes is good.
-   I think that they should rather be fine-tuned. */
+   I think that they should rather be fine-tuned.
+   These are now only where Camio.delay starts: it is raised when the
+   camera NAKs or misses what we send and eased after a clean run. */
 #ifndef OTHERDELAY
 #define WRTPKTDELAY       1250L
 #define WRTCMDDELAY       1250L
@@ -39,10 +42,23 @@
 #define WRTPRMDELAY        500L
 #define WRTDELAY          1000L
 #endif
+#define MINDELAY           100L
+#define MAXDELAYMUL          4	/* times the defaults */
+#define CLEANRUN            32	/* good exchanges before the delays are eased */
 #define SPEEDCHGDELAY   100	/* msec */
+#define LINEPROBES           4	/* clean probes for a speed to pass */
+#define TUNEMIN             16	/* packets before an error rate means anything */
+#define TUNEERRPCT           5	/* percent of packets in error to drop a speed */
+#define TUNEUP             512	/* clean packets before trying a speed up */
+#define QUIETBYTES          16	/* byte times of silence that end a resync */
+#define MINQUIET          5000L	/* usec; no shorter, the timer can't tell */
 
 #define SKIPNULS           200
 
+#define TIMERSLICE           5	/* msec; how late a shortened deadline can be seen */
+#define IOSTACK           8192
+#define HANGUPPOLL          10	/* msec between interrupts of a reader that won't stop */
+
 typedef struct Pkthdr Pkthdr;
 struct Pkthdr {
 	unsigned char typ;
@@ -69,6 +85,9 @@ enum {
 	PKT_DATA = 0x02,
 	PKT_LAST = 0x03,
 
+	/* not a command: Camio.cmd during eph_open's handshake */
+	CMD_INIT = 5,
+
 	/* command packet subtype in seq field (Pkthdr.seq) */
 	SEQ_INITCMD = 0x53,
 	SEQ_CMD = 0x43,
@@ -90,6 +109,16 @@ static int writeicmd(Camio *iob,void *data,long length);
 static int readpkt(Camio *iob,Pkthdr *pkthdr,void *buf,long *length,long usec);
 
 static int setispeed(Camio *iob,long val);
+static void startio(Camio *iob);
+static void hangup(Camio *iob);
+static void backoff(Camio *iob);
+static void easeoff(Camio *iob);
+static int speedcode(long speed);
+static int probespeed(Camio *iob);
+static int resync(Camio *iob,long usec);
+static void trace(Camio *iob,int dir,int typ,int seq,long len,int rc);
+static void dumptrace(Camio *iob);
+static void record(Camio *iob,int dir,void *p,long n);
 
 #define	ERRNO	0
 
@@ -104,24 +133,18 @@ eph_open(Camio *iob,char *devname,long speed)
 	int count=0;
 
 	if (speed == 0) speed=MAX_SPEED;
+	iob->cmd=CMD_INIT;
 
-	switch (speed) {
-	case 9600:
-		ephspeed=1;	break;
-	case 19200:
-		ephspeed=2;	break;
-	case 38400:
-		ephspeed=3;	break;
-	case 57600:
-		ephspeed=4;	break;
-	case 115200:
-		ephspeed=5;	break;
-	default:
+	iob->autospeed = speed == EPH_AUTO;
+	if (iob->autospeed)
+		ephspeed=0;
+	else if ((ephspeed=speedcode(speed)) < 0) {
 		eph_error(iob,ERR_BADSPEED,"specified speed %ld invalid",speed);
 		return -1;
 	}
 
-	iob->timeout=DATATIMEOUT+((2048000000L)/speed)*10;
+	iob->speed=DEFSPEED;
+	iob->timeout=DATATIMEOUT+((2048000000L)/DEFSPEED)*10;
 	if (iob->debug) print("set timeout to %lud\n",DATATIMEOUT+iob->timeout);
 
 	if ((iob->fd=open(devname,ORDWR)) < 0) {
@@ -129,6 +152,7 @@ eph_open(Camio *iob,char *devname,long speed)
 			eph_error(iob,ERRNO,"open %s error %r", devname);
 		return -1;
 	}
+	startio(iob);
 	sprint(ctlname, "%sctl", devname);
 	iob->cfd = open(ctlname, ORDWR);
 	if(iob->cfd >= 0){
@@ -143,8 +167,7 @@ eph_open(Camio *iob,char *devname,long speed)
 	do {
 		if (flushinput(iob)) {
 			eph_error(iob,ERRNO,"error flushing input: %r");
-			close(iob->cfd);
-			close(iob->fd);
+			hangup(iob);
 			return -1;
 		}
 		writeinit(iob);
@@ -153,24 +176,31 @@ eph_open(Camio *iob,char *devname,long speed)
 			sleep(3);
 	} while (rc && (count++ < RETRIES));
 	if (rc) {
-		close(iob->cfd);
-		close(iob->fd);
+		hangup(iob);
 		return -1;
 	}
 
+	if (iob->autospeed) {
+		if (probespeed(iob)) {
+			hangup(iob);
+			return -1;
+		}
+		return 0;
+	}
+
 	if (setispeed(iob,ephspeed)) {
 		eph_error(iob,ERRNO,"could not switch camera speed %d: %r",ephspeed);
-		close(iob->cfd);
-		close(iob->fd);
+		hangup(iob);
 		return -1;
 	}
 
 	if(iob->cfd >= 0 && fprint(iob->cfd, "b%ld", speed) < 0){
-		close(iob->cfd);
-		close(iob->fd);
+		hangup(iob);
 		return -1;
 	}
 
+	iob->speed=speed;
+	iob->timeout=DATATIMEOUT+((2048000000L)/speed)*10;
 	sleep(SPEEDCHGDELAY);
 	return 0;
 }
@@ -189,11 +219,8 @@ eph_close(Camio *iob,int switchoff)
 		setispeed(iob,0L);
 	}
 
-	if(iob->cfd >= 0){
-		close(iob->cfd);
-		iob->cfd = -1;
-	}
-	return close(iob->fd);
+	hangup(iob);
+	return 0;
 }
 
 /*
@@ -206,6 +233,8 @@ enum {
 };
 
 #define MAYRETRY(rc) ((rc == -2) || (rc == NAK))
+/* readpkt's crc or length error, or a packet that starts with rubbish */
+#define GARBLED(rc) ((rc == -1) || ((rc > 0) && (rc != NAK) && (rc != DC1)))
 
 static int
 writecmd(Camio *iob, void *data, long length)
@@ -226,6 +255,7 @@ setispeed(Camio *iob,long val)
 	int rc;
 	int count=0;
 
+	iob->cmd=CMD_INIT;
 	buf[0]=CMD_SETINT;
 	buf[1]=REG_SPEED;
 	buf[2]=(val)&0xff;
@@ -249,6 +279,7 @@ eph_setint(Camio *iob, int reg, long val)
 	int rc;
 	int count=0;
 
+	iob->cmd=CMD_SETINT;
 	buf[0]=CMD_SETINT;
 	buf[1]=reg;
 	buf[2]=(val)&0xff;
@@ -277,6 +308,7 @@ eph_getint(Camio *iob,int reg,long *val)
 	int count=0;
 
 	(*val)=0L;
+	iob->cmd=CMD_GETINT;
 	buf[0]=CMD_GETINT;
 	buf[1]=reg;
 
@@ -284,13 +316,16 @@ writeagain:
 	if ((rc=writecmd(iob,buf,2))) return rc;
 readagain:
 	rc=readpkt(iob,&pkt,buf,&size,BIGDATATIMEOUT);
+	if (MAYRETRY(rc)) backoff(iob);	/* command lost */
 	if (MAYRETRY(rc) && (count++ < RETRIES)) goto writeagain;
 	if ((rc == 0) && (pkt.typ == PKT_LAST) && (pkt.seq == 0)) {
+		easeoff(iob);
 		(*val)=((unsigned long)buf[0]) | ((unsigned long)buf[1]<<8) |
 			((unsigned long)buf[2]<<16) | ((unsigned long)buf[3]<<24);
 		writeack(iob);
 		return 0;
-	} else if ((rc == -1) && (count++ < RETRIES)) {
+	} else if (GARBLED(rc) && (count++ < RETRIES)) {
+		if (resync(iob,BIGDATATIMEOUT)) return -1;
 		writenak(iob);
 		goto readagain;
 	}
@@ -313,6 +348,7 @@ eph_action(Camio *iob,int reg,char *val,long length)
 		return -1;
 	}
 
+	iob->cmd=CMD_ACTION;
 	buf[0]=CMD_ACTION;
 	buf[1]=reg;
 	memmove(buf+2, val, length);
@@ -340,6 +376,7 @@ eph_setvar(Camio *iob,int reg,void *val,long length)
 	long written=0;
 	unsigned char *getpoint,*putpoint;
 
+	iob->cmd=CMD_SETVAR;
 	getpoint=val;
 	while (length && !rc) {
 		if (seq == -1) {
@@ -380,10 +417,17 @@ writeagain:
 	return rc;
 }
 
-int
-eph_getvar(Camio *iob,int reg,char **buffer,long *bufsize)
+/*
+ * with fixed set, *buffer holds *bufsize bytes and the value
+ * must be exactly that long: packets go straight to their
+ * place in it, only the last one, if it might not fit, is
+ * read aside first.
+ */
+static int
+getvar(Camio *iob,int reg,char **buffer,long *bufsize,int fixed)
 {
 	unsigned char buf[2];
+	char tail[EPHBSIZE];
 	Pkthdr pkt;
 	int rc;
 	int count=0;
@@ -413,14 +457,29 @@ eph_getvar(Camio *iob,int reg,char **buffer,long *bufsize)
 		}
 	}
 
+	iob->cmd=CMD_GETVAR;
 	buf[0]=CMD_GETVAR;
 	buf[1]=reg;
+	iob->stats.xstart=nsec();
+	iob->stats.xbytes=0;
 
 writeagain:
-	if ((rc=writecmd(iob,buf,2))) return rc;
+	if ((rc=writecmd(iob,buf,2))) {
+		free(tmpbuf);
+		iob->stats.xstart=0;
+		return rc;
+	}
 	index=0;
 readagain:
-	if (buffer) { /* read to memory reallocating it */
+	if (buffer && fixed) { /* read to the caller's buffer */
+		if ((*bufsize - index) >= EPHBSIZE) {
+			ptr=(*buffer)+index;
+			readsize=(*bufsize)-index;
+		} else {
+			ptr=tail;
+			readsize=sizeof tail;
+		}
+	} else if (buffer) { /* read to memory reallocating it */
 		if ((*bufsize - index) < 2048) {
 			if (iob->debug)
 				print("reallocing %lud",(unsigned long)(*bufsize));
@@ -432,6 +491,7 @@ readagain:
 			if (*buffer == nil) {
 				eph_error(iob,ERR_NOMEM, "could not realloc %lud for getvar",
 					(long)*bufsize);
+				iob->stats.xstart=0;
 				return -1;
 			}
 		}
@@ -442,7 +502,7 @@ readagain:
 		readsize=tmpbufsize;
 	}
 	rc=readpkt(iob,&pkt,ptr,&readsize,
-			(expect || ((reg != REG_IMG) || (reg != REG_TMN)))?
+			(expect || ((reg != REG_IMG) && (reg != REG_TMN)))?
 						DATATIMEOUT:BIGDATATIMEOUT);
 	if (MAYRETRY(rc) && (expect == 0) && (count++ < RETRIES)) {
 		writenak(iob);
@@ -452,56 +512,392 @@ readagain:
 	if ((rc == 0) &&
 	    ((pkt.seq == expect) || (pkt.seq  == (expect-1)))) {
 		count=0;
+		if (pkt.seq != expect)
+			backoff(iob);	/* a resend: our ACK was lost */
+		else
+			easeoff(iob);
 		if (pkt.seq == expect) {
+			if (ptr == tail) {
+				if (readsize > (*bufsize)-index) {
+					eph_error(iob,ERR_BADSIZE,
+						"getvar: more than the %ld bytes expected",*bufsize);
+					iob->stats.xstart=0;
+					return -1;
+				}
+				memmove((*buffer)+index,tail,readsize);
+			}
 			index+=readsize;
 			expect++;
+			iob->stats.xbytes=index;
 			(iob->runcb)(index);
 			if (buffer == nil) {
 				if (iob->debug)
 					print("storing %lud at %08lux\n",
 						(unsigned long)readsize,
 						(unsigned long)ptr);
-				if ((iob->storecb)(ptr,readsize))
+				if ((iob->storecb)(ptr,readsize)) {
+					free(tmpbuf);
+					iob->stats.xstart=0;
 					return -1;
+				}
 			}
 		}
 		writeack(iob);
 		if (pkt.typ == PKT_LAST) {
+			if (fixed && index != *bufsize) {
+				eph_error(iob,ERR_BADSIZE,
+					"getvar: got %ld bytes, expected %ld",index,*bufsize);
+				iob->stats.xstart=0;
+				return -1;
+			}
 			if (buffer) (*bufsize)=index;
 			if (tmpbuf) free(tmpbuf);
+			iob->stats.lastbytes=index;
+			iob->stats.lastns=nsec()-iob->stats.xstart;
+			iob->stats.xstart=0;
 			return 0;
 		}
 		else goto readagain;
 	}
-	if ((rc <= 0) && (count++ < RETRIES)) {
+	if (((rc <= 0) || GARBLED(rc)) && (count++ < RETRIES)) {
+		if (GARBLED(rc) && resync(iob,iob->timeout)) {
+			free(tmpbuf);
+			iob->stats.xstart=0;
+			return -1;
+		}
 		writenak(iob);
 		goto readagain;
 	}
 	if (tmpbuf) free(tmpbuf);
+	iob->stats.xstart=0;
 	if (count >= RETRIES)
 		eph_error(iob,ERR_EXCESSIVE_RETRY,
 				"excessive retries on getvar");
 	return rc;
 }
 
+int
+eph_getvar(Camio *iob,int reg,char **buffer,long *bufsize)
+{
+	return getvar(iob,reg,buffer,bufsize,0);
+}
+
+/*
+ * like eph_getvar for a value whose size is known: it is
+ * received straight into buf, which is never reallocated,
+ * and any other size is an error.
+ */
+int
+eph_getvarbuf(Camio *iob,int reg,char *buf,long size)
+{
+	return getvar(iob,reg,&buf,&size,1);
+}
+
 /*
  * packet i/o
  */
 
+/*
+ * sleep() only has milliseconds, and used to be given usec
+ * rounded up plus one; sleep the whole milliseconds and
+ * yield until the remainder is up.
+ */
+static void
+shortsleep(Camio *iob,long usec)
+{
+	vlong t0,end;
+
+	t0=nsec();
+	end=t0+usec*1000LL;
+	if (usec >= 1000)
+		sleep(usec/1000);
+	while (nsec() < end)
+		sleep(0);
+	iob->stats.sleepns+=nsec()-t0;
+}
+
+static long defdelay[DL_N] = {
+	[DL_PKT]	WRTPKTDELAY,
+	[DL_CMD]	WRTCMDDELAY,
+	[DL_PRM]	WRTPRMDELAY,
+	[DL_BYTE]	WRTDELAY,
+};
+
+/* the camera lost something we sent: slow down */
+static void
+backoff(Camio *iob)
+{
+	int i;
+
+	for (i=0;i<DL_N;i++) {
+		iob->delay[i]*=2;
+		if (iob->delay[i] < MINDELAY)
+			iob->delay[i]=MINDELAY;
+		if (iob->delay[i] > MAXDELAYMUL*defdelay[i])
+			iob->delay[i]=MAXDELAYMUL*defdelay[i];
+	}
+	iob->clean=0;
+	iob->stats.backoffs++;
+	if (iob->debug)
+		print("delays up to %ld %ld %ld %ld\n",
+			iob->delay[0],iob->delay[1],iob->delay[2],iob->delay[3]);
+}
+
+/* it got through: after a run of these, speed up a little */
 static void
-shortsleep(int nsec)
+easeoff(Camio *iob)
 {
-	sleep((nsec+999)/1000+1);
+	int i;
+
+	if (++iob->clean < CLEANRUN)
+		return;
+	iob->clean=0;
+	for (i=0;i<DL_N;i++) {
+		iob->delay[i]-=iob->delay[i]/8;
+		if (iob->delay[i] < MINDELAY)
+			iob->delay[i]=MINDELAY;
+	}
+}
+
+/*
+ * find the shortest delays this camera copes with: start from
+ * the minimum and let the usual backing off raise them until a
+ * run of probes goes through without one.
+ */
+int
+eph_calibrate(Camio *iob)
+{
+	ulong nb;
+	long val;
+	int i,good,tries;
+
+	for (i=0;i<DL_N;i++)
+		iob->delay[i]=MINDELAY;
+	good=0;
+	for (tries=0;tries<8*CLEANRUN && good<CLEANRUN;tries++) {
+		nb=iob->stats.backoffs;
+		if (eph_getint(iob,1,&val) == 0 &&
+		    eph_setint(iob,REG_FRAME,1) == 0 && iob->stats.backoffs == nb)
+			good++;
+		else
+			good=0;
+	}
+	iob->clean=0;
+	if (iob->debug)
+		print("calibrated delays %ld %ld %ld %ld after %d probes\n",
+			iob->delay[0],iob->delay[1],iob->delay[2],iob->delay[3],tries);
+	return good<CLEANRUN? -1: 0;
+}
+
+/*
+ * line speeds, fastest first, and the camera's codes for them
+ */
+static struct {
+	long speed;
+	int code;
+} speeds[] = {
+	{	115200,	5	},
+	{	57600,	4	},
+	{	38400,	3	},
+	{	19200,	2	},
+	{	9600,	1	},
+};
+
+static int
+speedidx(long speed)
+{
+	int i;
+
+	for (i=0;i<nelem(speeds);i++)
+		if (speeds[i].speed == speed)
+			return i;
+	return -1;
+}
+
+static int
+speedcode(long speed)
+{
+	int i;
+
+	if ((i=speedidx(speed)) < 0)
+		return -1;
+	return speeds[i].code;
+}
+
+/* switch the camera, then the uart */
+static int
+switchspeed(Camio *iob,long speed)
+{
+	int code;
+
+	if ((code=speedcode(speed)) < 0) {
+		eph_error(iob,ERR_BADSPEED,"specified speed %ld invalid",speed);
+		return -1;
+	}
+	if (setispeed(iob,code))
+		return -1;
+	if (iob->cfd >= 0 && fprint(iob->cfd, "b%ld", speed) < 0)
+		return -1;
+	iob->speed=speed;
+	iob->timeout=DATATIMEOUT+((2048000000L)/speed)*10;
+	sleep(SPEEDCHGDELAY);
+	if (iob->debug)
+		print("line speed %ld\n",speed);
+	return 0;
+}
+
+static ulong
+linerrs(Camio *iob)
+{
+	ulong n;
+	int i;
+
+	n=0;
+	for (i=0;i<ST_NCMD;i++)
+		n+=iob->stats.errs[i][ST_CRC]+iob->stats.errs[i][ST_TIMEOUT];
+	return n;
+}
+
+/* does the line carry a few exchanges without a crc error or timeout? */
+static int
+linetest(Camio *iob)
+{
+	ulong e;
+	long val;
+	int i;
+
+	e=linerrs(iob);
+	for (i=0;i<LINEPROBES;i++)
+		if (eph_getint(iob,1,&val))
+			return 0;
+	return linerrs(iob) == e;
+}
+
+static void
+tunemark(Camio *iob)
+{
+	iob->tpkts=iob->stats.pktsin;
+	iob->terrs=linerrs(iob);
+}
+
+/*
+ * from the fastest speed down, the first that passes the line
+ * test.  if a switch fails half way, the next one is tried at
+ * the speed the uart was left at, which is where the camera
+ * went if it got the command.
+ */
+static int
+probespeed(Camio *iob)
+{
+	int i;
+
+	for (i=0;i<nelem(speeds);i++)
+		if (iob->speedcap > 0 && speeds[i].speed > iob->speedcap)
+			continue;
+		else if (switchspeed(iob,speeds[i].speed) == 0 && linetest(iob)) {
+			iob->maxspeed=speeds[i].speed;
+			tunemark(iob);
+			return 0;
+		}
+	eph_error(iob,ERR_BADSPEED,"no speed passes the line test");
+	return -1;
+}
+
+/* can eph_open or eph_setspeed be given speed? */
+int
+eph_validspeed(long speed)
+{
+	return speed == EPH_AUTO || speedidx(speed) >= 0;
+}
+
+/*
+ * set the speed of an open line; EPH_AUTO probes for the
+ * fastest and lets eph_tune follow the line from there.
+ */
+int
+eph_setspeed(Camio *iob,long speed)
+{
+	iob->speedcap=0;
+	if (speed == EPH_AUTO) {
+		iob->autospeed=1;
+		return probespeed(iob);
+	}
+	iob->autospeed=0;
+	return switchspeed(iob,speed);
+}
+
+/*
+ * in auto mode, after a transfer failed: the probes can pass
+ * at a speed bulk data doesn't, so cap the next session's
+ * probe one speed below this one.  returns 1 if it did; the
+ * cap stays until eph_setspeed.
+ */
+int
+eph_stepdown(Camio *iob)
+{
+	int i;
+
+	if (!iob->autospeed || (i=speedidx(iob->speed)) < 0 || i+1 >= nelem(speeds))
+		return 0;
+	iob->speedcap=speeds[i+1].speed;
+	if (iob->maxspeed > iob->speedcap)
+		iob->maxspeed=iob->speedcap;
+	iob->stats.speeddowns++;
+	return 1;
+}
+
+/*
+ * in auto mode, to be called between transfers: drop a speed
+ * when more than TUNEERRPCT% of the packets since the last look
+ * came with crc errors or timeouts, and after TUNEUP clean ones
+ * try the next speed up, as far as the probed one, coming back
+ * down if it fails the line test.  returns 1 if the speed changed.
+ */
+int
+eph_tune(Camio *iob)
+{
+	ulong pk,er;
+	int i;
+
+	if (!iob->autospeed || (i=speedidx(iob->speed)) < 0)
+		return 0;
+	pk=iob->stats.pktsin-iob->tpkts;
+	er=linerrs(iob)-iob->terrs;
+	if (pk+er >= TUNEMIN && er*100 > (pk+er)*TUNEERRPCT) {
+		tunemark(iob);
+		if (i+1 >= nelem(speeds))
+			return 0;
+		iob->stats.speeddowns++;
+		if (switchspeed(iob,speeds[i+1].speed))
+			return -1;
+		tunemark(iob);
+		return 1;
+	}
+	if (pk < TUNEUP)
+		return 0;
+	tunemark(iob);
+	if (er > 0 || i == 0 || speeds[i-1].speed > iob->maxspeed)
+		return 0;
+	iob->stats.speedups++;
+	if (switchspeed(iob,speeds[i-1].speed) == 0 && linetest(iob)) {
+		tunemark(iob);
+		return 1;
+	}
+	iob->stats.speeddowns++;
+	if (switchspeed(iob,speeds[i].speed))
+		return -1;
+	tunemark(iob);
+	return 0;
 }
 
 static struct _chunk {
 	long offset;
 	long size;
-	unsigned long delay;
+	int delay;	/* index in Camio.delay */
 } chunk[] = {
-	{	0,	1,	WRTPKTDELAY	},
-	{	1,	3,	WRTCMDDELAY},
-	{	4,	0,	WRTPRMDELAY	}
+	{	0,	1,	DL_PKT	},
+	{	1,	3,	DL_CMD	},
+	{	4,	0,	DL_PRM	}
 };
 #define MAXCHUNK 3
 
@@ -530,7 +926,7 @@ writepkt(Camio *iob,int typ,int seq,void *adata,long length)
 	}
 	buf[i++]=crc&0xff;
 	buf[i++]=crc>>8;
-	if (iob->debug) {
+	if (iob->debug > 1) {
 		print("> (%d)",i);
 		for (j=0;j<i;j++) {
 			print(" %.2x",buf[j]);
@@ -541,12 +937,17 @@ writepkt(Camio *iob,int typ,int seq,void *adata,long length)
 	for (j=0;j<MAXCHUNK;j++) {
 		long sz=(chunk[j].size)?(chunk[j].size)
 						:(i-chunk[j].offset);
-		shortsleep(chunk[j].delay);
+		shortsleep(iob,iob->delay[chunk[j].delay]);
 		if (write(iob->fd,buf+chunk[j].offset,sz) != sz) {
+			trace(iob,'>',typ,seq,length,-1);
 			eph_error(iob,ERRNO,"pkt write chunk %d(%d) error %r",j,(int)sz);
 			return -1;
 		}
+		record(iob,'>',buf+chunk[j].offset,sz);
 	}
+	trace(iob,'>',typ,seq,length,0);
+	iob->stats.pktsout++;
+	iob->stats.bytesout+=i;
 	return 0;
 }
 
@@ -556,11 +957,17 @@ putbyte(Camio *iob, int c)
 	uchar buf[1];
 
 	buf[0] = c;
-	if(iob->debug)
+	if(iob->debug > 1)
 		print("> %.2x\n", c);
-	shortsleep(WRTDELAY);
-	if(write(iob->fd, buf, sizeof(buf)) != sizeof(buf))
+	shortsleep(iob, iob->delay[DL_BYTE]);
+	if(write(iob->fd, buf, sizeof(buf)) != sizeof(buf)){
+		trace(iob, '>', c, 0, 0, -1);
 		eph_error(iob, ERRNO, "%.2x write error %r", c);
+	}else{
+		trace(iob, '>', c, 0, 0, 0);
+		record(iob, '>', buf, 1);
+		iob->stats.bytesout++;
+	}
 }
 
 static void
@@ -578,59 +985,272 @@ writeack(Camio *iob)
 static void
 writenak(Camio *iob)
 {
+	iob->stats.naks++;
 	putbyte(iob, NAK);
 }
 
-static	int	first = 1;
+/*
+ * the line is read by a reader proc, which passes what it
+ * gets over iob->rdc, and timeouts come from a timer proc:
+ * fill alts on the two, so there are no alarms or notes and
+ * each Camio is independent of any other.
+ */
+
+typedef struct Rblock Rblock;
+struct Rblock {
+	long n;		/* < 0: read error, 0: end of file */
+	char err[ERRMAX];
+	uchar data[1];
+};
 
-static int
-ding(void *a, char *msg)
+typedef struct Tmr Tmr;
+struct Tmr {
+	vlong dl;	/* nsec() to fire at; < 0 to exit */
+	ulong gen;
+};
+
+static void
+readproc(void *a)
 {
-	USED(a);
-	if(strcmp(msg, "alarm") == 0)
-		return 1;
-	return 0;
+	Camio *iob = a;
+	Rblock *b;
+	long n;
+
+	threadsetname("ephread");
+	while (!iob->stop) {
+		n = read(iob->fd, iob->ibuf, sizeof iob->ibuf);
+		if (iob->stop)
+			break;
+		record(iob, '<', iob->ibuf, n);
+		b = malloc(sizeof(Rblock)+(n > 0? n: 0));
+		if (b == nil)
+			break;
+		b->n = n;
+		b->err[0] = 0;
+		if (n < 0)
+			rerrstr(b->err, sizeof b->err);
+		else
+			memmove(b->data, iob->ibuf, n);
+		if (sendp(iob->rdc, b) < 0) {	/* interrupted by hangup */
+			free(b);
+			break;
+		}
+		if (n <= 0)
+			break;
+	}
+	sendul(iob->exitc, 1);
 }
 
-static long
-readt(Camio *iob,void *buf,long length,long usec,int *rc)
+/* replace whatever deadline is pending with t */
+static void
+settimer(Camio *iob,Tmr *t)
 {
-	char err[ERRMAX];
-	int n;
+	Tmr old;
+
+	while (nbsend(iob->tset, t) == 0)
+		nbrecv(iob->tset, &old);
+}
 
-	if(first){
-		first = 0;
-		atnotify(ding, 1);
+static void
+timerproc(void *a)
+{
+	Camio *iob = a;
+	Tmr t, n;
+	vlong left;
+	int armed;
+
+	threadsetname("ephtimer");
+	armed = 0;
+	for (;;) {
+		if (!armed) {
+			recv(iob->tset, &t);
+			armed = 1;
+		}
+		while (nbrecv(iob->tset, &n) > 0)
+			t = n;
+		if (t.dl < 0)
+			break;
+		left = t.dl-nsec();
+		if (left <= 0) {
+			while (nbsendul(iob->tfire, t.gen) == 0)
+				nbrecvul(iob->tfire);	/* an expiry nobody waited for */
+			armed = 0;
+		} else if (left >= 1000000)
+			sleep(left/1000000 < TIMERSLICE? left/1000000: TIMERSLICE);
+		else
+			sleep(0);
 	}
+	sendul(iob->exitc, 0);
+}
+
+static void
+startio(Camio *iob)
+{
+	iob->rp = iob->re = 0;
+	iob->rerr = 0;
+	iob->stop = 0;
+	iob->rdc = chancreate(sizeof(Rblock*), 32);
+	iob->tset = chancreate(sizeof(Tmr), 1);
+	iob->tfire = chancreate(sizeof(ulong), 1);
+	iob->exitc = chancreate(sizeof(ulong), 2);
+	iob->rtid = proccreate(readproc, iob, IOSTACK);
+	proccreate(timerproc, iob, IOSTACK);
+}
+
+/* stop the procs and close the line */
+static void
+hangup(Camio *iob)
+{
+	Tmr t;
+	Rblock *b;
+	ulong who;
+	int n, rdone;
+
+	if (iob->rdc == nil)
+		return;
+	t.dl = -1;
+	t.gen = 0;
+	settimer(iob, &t);
+	/*
+	 * an interrupt that lands between the reader's reads is
+	 * lost, so keep sending them until it says it has gone;
+	 * stop keeps it from starting another read meanwhile.
+	 */
+	iob->stop = 1;
+	rdone = 0;
+	for (n = 0; n < 2; ) {
+		if (nbrecv(iob->exitc, &who) > 0) {
+			n++;
+			if (who)
+				rdone = 1;
+			continue;
+		}
+		if (!rdone)
+			threadint(iob->rtid);
+		sleep(HANGUPPOLL);
+	}
+	while ((b = nbrecvp(iob->rdc)) != nil)
+		free(b);
+	chanfree(iob->rdc);
+	chanfree(iob->tset);
+	chanfree(iob->tfire);
+	chanfree(iob->exitc);
+	iob->rdc = nil;
+	if(iob->cfd >= 0){
+		close(iob->cfd);
+		iob->cfd = -1;
+	}
+	close(iob->fd);
+	iob->fd = -1;
+	if (iob->rec != nil)
+		Bflush(iob->rec);
+}
+
+static vlong
+deadline(long usec)
+{
+	return nsec()+usec*1000LL;
+}
+
+/*
+ * wait until the deadline for the reader's next block
+ * and put it in the empty iob->rbuf.
+ */
+static long
+fill(Camio *iob,vlong dl,int *rc)
+{
+	Rblock *b;
+	Tmr t;
+	ulong g;
+	long n;
+	Alt a[3];
+
+	if (iob->rerr) {
+		werrstr("camera line closed");
+		*rc = -1;
+		return -1;
+	}
+	if ((b = nbrecvp(iob->rdc)) == nil) {
+		t.dl = dl;
+		t.gen = ++iob->tgen;
+		settimer(iob, &t);
+		a[0].c = iob->rdc;
+		a[0].v = &b;
+		a[0].op = CHANRCV;
+		a[1].c = iob->tfire;
+		a[1].v = &g;
+		a[1].op = CHANRCV;
+		a[2].op = CHANEND;
+		for (;;) {
+			switch (alt(a)) {
+			case 0:
+				break;
+			case 1:
+				if (g != t.gen)
+					continue;	/* an old deadline */
+				*rc = 0;
+				return 0;
+			default:
+				werrstr("interrupted");
+				*rc = -1;
+				return -1;
+			}
+			break;
+		}
+	}
+	n = b->n;
+	if (n <= 0) {
+		iob->rerr = 1;
+		werrstr("%s", n < 0? b->err: "eof");
+		free(b);
+		*rc = n<0?-1:1;
+		return n;
+	}
+	memmove(iob->rbuf, b->data, n);
+	free(b);
+	iob->re = n;
+	iob->stats.bytesin+=n;
+	*rc = 1;
+	return n;
+}
+
+/*
+ * hand out up to length bytes from iob->rbuf; only an
+ * empty buffer costs a read.  returns as read(2) does,
+ * with *rc 0 for a timeout.
+ */
+static long
+readt(Camio *iob,void *buf,long length,vlong dl,int *rc)
+{
+	long n;
+
 	if (length == 0)
 		return 0;
-	alarm((usec+1000)/1000);
-	n = read(iob->fd, buf, length);
-	alarm(0);
-	if(n < 0){
-		err[0] = 0;
-		errstr(err, sizeof err);
-		if(strcmp(err, "interrupted") == 0){
-			errstr(err, sizeof err);
-			*rc = 0;
-			return 0;
-		}
-		errstr(err, sizeof err);
+	if (iob->rp == iob->re) {
+		iob->rp = iob->re = 0;
+		if ((n = fill(iob,dl,rc)) <= 0)
+			return n;
 	}
-	*rc = n<0?-1:1;
+	n = iob->re-iob->rp;
+	if (n > length)
+		n = length;
+	memmove(buf, iob->rbuf+iob->rp, n);
+	iob->rp+=n;
+	*rc = 1;
 	return n;
 }
 
 static int
-readpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
+rdpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
 {
 	ushort length,got;
 	ushort crc1=0,crc2;
 	unsigned char buf[4];
 	int i,rc;
+	vlong dl;
 
-	i=readt(iob,buf,1,usec,&rc);
-	if (iob->debug)
+	i=readt(iob,buf,1,deadline(usec),&rc);
+	if (iob->debug > 1)
 		print("pktstart: i=%d rc=%d char=0x%.2ux\n",i,rc,*buf);
 	if (i < 0) {
 		eph_error(iob,ERRNO,"pkt start read error %r");
@@ -650,7 +1270,8 @@ readpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
 		return *buf;
 	}
 	got=0;
-	while ((i=readt(iob,buf+1+got,3-got,DATATIMEOUT,&rc)) > 0) {
+	dl=deadline(DATATIMEOUT);
+	while ((i=readt(iob,buf+1+got,3-got,dl,&rc)) > 0) {
 		got+=i;
 	}
 	if (got != 3) {
@@ -667,7 +1288,7 @@ readpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
 			return -1;
 		}
 	}
-	if (iob->debug)
+	if (iob->debug > 1)
 		print("header: %.2x %.2x %.2x %.2x\n", buf[0],buf[1],buf[2],buf[3]);
 	pkthdr->seq=buf[1];
 	length=(buf[3]<<8)|buf[2];
@@ -678,7 +1299,8 @@ readpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
 	}
 
 	got=0;
-	while ((i=readt(iob,buffer+got,length-got,iob->timeout,&rc)) > 0) {
+	dl=deadline(iob->timeout);
+	while ((i=readt(iob,buffer+got,length-got,dl,&rc)) > 0) {
 		got+=i;
 	}
 	if (got != length) {
@@ -701,10 +1323,11 @@ readpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
 	}
 
 	got=0;
-	while ((i=readt(iob,buf+got,2-got,DATATIMEOUT,&rc)) > 0) {
+	dl=deadline(DATATIMEOUT);
+	while ((i=readt(iob,buf+got,2-got,dl,&rc)) > 0) {
 		got+=i;
 	}
-	if (iob->debug)
+	if (iob->debug > 1)
 		print("crc: %.2ux %.2ux i=%d rc=%d\n",buf[0],buf[1],i,rc);
 	if (got != 2) {
 		if (i < 0) {
@@ -728,38 +1351,110 @@ readpkt(Camio *iob,Pkthdr *pkthdr,char *buffer,long *bufsize,long usec)
 			"crc received=0x%04x counted=0x%04x",crc2,crc1);
 		return -1;
 	}
-	if (iob->debug) {
+	if (iob->debug > 1) {
 		int j;
 
 		print("< %d,%d (%d)",pkthdr->typ,pkthdr->seq,length);
-		if (iob->debug > 1) for (j=0;j<length;j++) {
+		for (j=0;j<length;j++)
 			print(" %.2ux",(unsigned char)buffer[j]);
-		} else print(" ...");
 		print("\n");
 		print("< %d,%d (%d)",pkthdr->typ,pkthdr->seq,length);
-		if (iob->debug > 1) for (j=0;j<length;j++) {
+		for (j=0;j<length;j++)
 			print(" %c ",(buffer[j] >= ' ' && buffer[j] < 127)
 							? buffer[j] : '.');
-		} else print(" ...");
 		print("\n");
 	}
 	(*bufsize)=length;
+	iob->stats.pktsin++;
+	if (iob->stats.errat) {
+		iob->stats.recovns+=nsec()-iob->stats.errat;
+		iob->stats.nrecov++;
+		iob->stats.errat=0;
+	}
 	return 0;
 }
 
+/* rdpkt, and a trace entry for whatever came of it */
 static int
-flushinput(Camio *iob) {
+readpkt(Camio *iob,Pkthdr *pkthdr,void *buf,long *bufsize,long usec)
+{
+	int rc;
+
+	pkthdr->typ=pkthdr->seq=0;
+	rc=rdpkt(iob,pkthdr,buf,bufsize,usec);
+	trace(iob,'<',pkthdr->typ,pkthdr->seq,rc == 0? *bufsize: 0,rc);
+	return rc;
+}
+
+/*
+ * after a garbled packet the rest of it, or more rubbish, may
+ * still be coming: throw bytes away until the line has been
+ * quiet for QUIETBYTES byte times (or usec have gone by), so
+ * that the resend our NAK asks for is read from its start
+ * rather than failing again on the tail of this one.
+ */
+static int
+resync(Camio *iob,long usec)
+{
 	unsigned char buf;
+	vlong t0,dl,q;
+	uvlong n;
+	long gap;
 	int i,rc;
 
-	i=readt(iob,&buf,1,0L,&rc);
+	t0=nsec();
+	if (iob->stats.errat == 0)
+		iob->stats.errat=t0;
+	iob->stats.resyncs++;
+	n=iob->stats.discarded;
+	gap=QUIETBYTES*10*1000000LL/(iob->speed? iob->speed: DEFSPEED);
+	if (gap < MINQUIET)
+		gap=MINQUIET;
+	dl=deadline(usec);
+	iob->stats.discarded+=iob->re-iob->rp;
+	iob->rp=iob->re;
+	do {
+		q=deadline(gap);
+		i=readt(iob,&buf,1,q < dl? q: dl,&rc);
+		if (i > 0)
+			iob->stats.discarded++;
+	} while (i > 0 && nsec() < dl);
+	iob->stats.resyncns+=nsec()-t0;
+	n=iob->stats.discarded-n;
+	trace(iob,'~',0,0,n > 0xffff? 0xffff: n,i < 0? -1: 0);
 	if (iob->debug)
+		print("resync: %lld ms\n",(nsec()-t0)/1000000);
+	if (i < 0) {
+		eph_error(iob,ERRNO,"resync read error %r");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+flushinput(Camio *iob) {
+	unsigned char buf;
+	int i,rc;
+	Rblock *b;
+
+	iob->rp=iob->re=0;	/* forget anything buffered */
+	while ((b=nbrecvp(iob->rdc)) != nil) {
+		if (b->n <= 0) {
+			iob->rerr=1;
+			werrstr("%s", b->n < 0? b->err: "eof");
+			free(b);
+			return -1;
+		}
+		free(b);
+	}
+	i=readt(iob,&buf,1,deadline(0),&rc);
+	if (iob->debug > 1)
 		print("< %.2ux amount=%d rc=%d\n",buf,i,rc);
 	if (i < 0) {
 		eph_error(iob,ERRNO,"flushinput read error %r");
 		return -1;
 	} else if ((i == 0) && (rc == 0)) {
-		if (iob->debug)
+		if (iob->debug > 1)
 			print("flushed: read %d amount=%d rc=%d\n",buf,i,rc);
 		return 0;
 	} else {
@@ -774,9 +1469,10 @@ eph_waitchar(Camio *iob, ulong usec)
 	unsigned char buf;
 	int i,rc;
 
-	i=readt(iob,&buf,1,usec,&rc);
-	if (iob->debug)
+	i=readt(iob,&buf,1,deadline(usec),&rc);
+	if (iob->debug > 1)
 		print("< %.2ux amount=%d rc=%d\n",buf,i,rc);
+	trace(iob,'<',i == 1? buf: 0,0,0,i == 1? 0: (i < 0? -1: -2));
 	if (i < 0) {
 		eph_error(iob,ERRNO,"waitchar read error %r");
 		return -1;
@@ -795,7 +1491,12 @@ static int
 waitack(Camio *iob, long usec)
 {
 	int rc;
-	if ((rc=eph_waitchar(iob,usec)) == ACK) return 0;
+	if ((rc=eph_waitchar(iob,usec)) == ACK) {
+		easeoff(iob);
+		return 0;
+	}
+	if ((rc == NAK) || (rc == -2))
+		backoff(iob);
 	if ((rc != DC1) && (rc != NAK))
 		eph_error(iob,ERR_BADREAD,"waitack got %d",rc);
 	return rc;
@@ -867,12 +1568,15 @@ eph_new(void (*errorcb)(int errcode,char *errstr),
 	iob->debug = debug;
 	iob->fd = -1;
 	iob->cfd = -1;
+	iob->rp = iob->re = 0;
+	memmove(iob->delay, defdelay, sizeof iob->delay);
 	return iob;
 }
 
 void
 eph_free(Camio *iob)
 {
+	eph_record(iob, -1);
 	free(iob);
 }
 
@@ -886,7 +1590,7 @@ static char *eph_errmsg[] = {
 	/* 10007 */	"No memory",
 	/* 10008 */	"Bad arguments",
 	/* 10009 */	"",
-	/* 10010 */	"",
+	/* 10010 */	"Unexpected data size",
 	/* 10011 */	"",
 	/* 10012 */	"",
 	/* 10013 */	"",
@@ -894,6 +1598,161 @@ static char *eph_errmsg[] = {
 	/* 10015 */	"",
 };
 
+static char *cmdname[ST_NCMD] = {
+	[CMD_SETINT]	"setint",
+	[CMD_GETINT]	"getint",
+	[CMD_ACTION]	"action",
+	[CMD_SETVAR]	"setvar",
+	[CMD_GETVAR]	"getvar",
+	[CMD_INIT]	"init",
+};
+
+/*
+ * the trace: trace() is on every frame's path, so it only
+ * fills in an entry; the formatting is left to whoever asks.
+ */
+static void
+trace(Camio *iob,int dir,int typ,int seq,long len,int rc)
+{
+	Ephtrace *t;
+
+	t=&iob->trace[iob->ntrace++%EPH_NTRACE];
+	t->ns=nsec();
+	t->dir=dir;
+	t->typ=typ;
+	t->seq=seq;
+	t->cmd=iob->cmd;
+	t->len=len;
+	t->rc=rc;
+}
+
+static char*
+fmtent(char *p,char *e,Ephtrace *t,vlong t0,vlong prev)
+{
+	char *what,tb[8];
+
+	if (t->dir == '~')
+		what="drain";
+	else switch (t->typ) {
+	case PKT_CMD:	what="cmd"; break;
+	case PKT_DATA:	what="data"; break;
+	case PKT_LAST:	what="last"; break;
+	case ACK:	what="ack"; break;
+	case NAK:	what="nak"; break;
+	default:
+		snprint(tb,sizeof tb,"%.2ux",t->typ);
+		what=tb;
+		break;
+	}
+	return seprint(p,e,"%10.3f %+9.3f %c %-5s seq %.2ux len %4ud rc %d %s\n",
+		(t->ns-t0)/1e6,(t->ns-prev)/1e6,t->dir,what,t->seq,t->len,t->rc,
+		t->cmd < ST_NCMD? cmdname[t->cmd]: "-");
+}
+
+/*
+ * the last n entries (all there are if n <= 0), oldest first:
+ * ms since the first shown, ms since the one before, direction,
+ * type, sequence, length, result and the command under way.
+ */
+char *
+eph_fmttrace(Camio *iob,char *p,char *e,int n)
+{
+	ulong i,first,last;
+	vlong prev;
+
+	last=iob->ntrace;
+	if (n <= 0 || n > EPH_NTRACE)
+		n=EPH_NTRACE;
+	first=last > n? last-n: 0;
+	if (first == last)
+		return p;
+	prev=iob->trace[first%EPH_NTRACE].ns;
+	for (i=first;i<last && p<e;i++) {
+		p=fmtent(p,e,&iob->trace[i%EPH_NTRACE],iob->trace[first%EPH_NTRACE].ns,prev);
+		prev=iob->trace[i%EPH_NTRACE].ns;
+	}
+	return p;
+}
+
+/* after an error: what led up to it, not repeating the last dump */
+static void
+dumptrace(Camio *iob)
+{
+	char *buf,*e;
+	ulong n;
+
+	n=iob->ntrace-iob->tdumped;
+	if (n > iob->tracedump)
+		n=iob->tracedump;
+	iob->tdumped=iob->ntrace;
+	if (n == 0 || (buf=malloc(n*80)) == nil)
+		return;
+	e=eph_fmttrace(iob,buf,buf+n*80,n);
+	write(2,buf,e-buf);
+	free(buf);
+}
+
+/*
+ * the recording: called from readproc as well as the
+ * protocol's proc, so the two take turns on the Biobuf.
+ */
+static void
+record(Camio *iob,int dir,void *p,long n)
+{
+	uchar h[EPH_RECHDR];
+	vlong now,dt;
+
+	if (iob->rec == nil || n <= 0)
+		return;
+	qlock(&iob->reclk);
+	now=nsec();
+	dt=iob->recns? (now-iob->recns)/1000: 0;
+	if (dt > 0xffffffffLL)
+		dt=0xffffffffLL;
+	iob->recns=now;
+	h[0]=dir;
+	h[1]=n;
+	h[2]=n>>8;
+	h[3]=dt;
+	h[4]=dt>>8;
+	h[5]=dt>>16;
+	h[6]=dt>>24;
+	Bwrite(iob->rec,h,sizeof h);
+	Bwrite(iob->rec,p,n);
+	qunlock(&iob->reclk);
+}
+
+/*
+ * record everything that crosses the line to fd from now on,
+ * for ephreplay to play back; fd < 0 stops.  fd is not closed.
+ */
+int
+eph_record(Camio *iob,int fd)
+{
+	Biobuf *b;
+
+	b=nil;
+	if (fd >= 0) {
+		if ((b=malloc(sizeof(Biobuf))) == nil)
+			return -1;
+		Binit(b,fd,OWRITE);
+		if (Bwrite(b,EPH_RECMAGIC,strlen(EPH_RECMAGIC)) < 0) {
+			Bterm(b);
+			free(b);
+			return -1;
+		}
+	}
+	qlock(&iob->reclk);
+	if (iob->rec != nil) {
+		Bterm(iob->rec);
+		free(iob->rec);
+	}
+	iob->rec=b;
+	iob->recns=0;
+	qunlock(&iob->reclk);
+	return 0;
+}
+
 /*
   We do not do any buffer override checks here because we are sure
   that the function is called *only* from within our library.
@@ -915,5 +1774,63 @@ eph_error (Camio *iob,int err,char *fmt,...)
 			sprint(msgbuf, "%r");
 	}
 	va_end(ap);
+	if (iob->cmd >= 0 && iob->cmd < ST_NCMD)
+		switch (err) {
+		case ERR_BADCRC:
+			iob->stats.errs[iob->cmd][ST_CRC]++;
+			break;
+		case ERR_TIMEOUT:
+			iob->stats.errs[iob->cmd][ST_TIMEOUT]++;
+			break;
+		case ERR_EXCESSIVE_RETRY:
+			iob->stats.errs[iob->cmd][ST_RETRY]++;
+			break;
+		}
 	iob->errorcb(err,msgbuf);
+	if (iob->tracedump > 0)
+		dumptrace(iob);
+}
+
+static long
+rate(vlong bytes,vlong ns)
+{
+	if (ns <= 0)
+		return 0;
+	return bytes*1000000000LL/ns;
+}
+
+/*
+ * the counters as text, one "name value..." line each,
+ * for monitoring to scrape.
+ */
+char *
+eph_fmtstats(Camio *iob,char *p,char *e)
+{
+	Ephstats *s;
+	vlong ns;
+	int i;
+
+	s=&iob->stats;
+	p=seprint(p,e,"pktsin %lud\npktsout %lud\n",s->pktsin,s->pktsout);
+	p=seprint(p,e,"bytesin %llud\nbytesout %llud\n",s->bytesin,s->bytesout);
+	p=seprint(p,e,"naks %lud\n",s->naks);
+	p=seprint(p,e,"resyncs %lud discarded %llud ms %lld recovered %lud avg %lldms\n",
+		s->resyncs,s->discarded,s->resyncns/1000000,s->nrecov,
+		s->nrecov? s->recovns/s->nrecov/1000000: 0);
+	p=seprint(p,e,"line %ld%s max %ld cap %ld up %lud down %lud\n",iob->speed,
+		iob->autospeed? " auto": "",iob->maxspeed,iob->speedcap,s->speedups,s->speeddowns);
+	p=seprint(p,e,"sleepms %lld\n",s->sleepns/1000000);
+	p=seprint(p,e,"delays %ld %ld %ld %ld backoffs %lud\n",
+		iob->delay[DL_PKT],iob->delay[DL_CMD],iob->delay[DL_PRM],iob->delay[DL_BYTE],s->backoffs);
+	for (i=0;i<ST_NCMD;i++)
+		p=seprint(p,e,"errors %s crc %lud timeout %lud retry %lud\n",cmdname[i],
+			s->errs[i][ST_CRC],s->errs[i][ST_TIMEOUT],s->errs[i][ST_RETRY]);
+	p=seprint(p,e,"lastxfer %lld bytes %lld ms %ld bytes/s\n",
+		s->lastbytes,s->lastns/1000000,rate(s->lastbytes,s->lastns));
+	if (s->xstart) {
+		ns=nsec()-s->xstart;
+		p=seprint(p,e,"curxfer %lld bytes %lld ms %ld bytes/s\n",
+			s->xbytes,ns/1000000,rate(s->xbytes,ns));
+	}
+	return p;
 }
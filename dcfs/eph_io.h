@@ -24,6 +24,78 @@ typedef long time_t;
 #define DC1 0x11
 
 #define MAX_SPEED 115200
+#define EPH_AUTO	(-1)	/* a speed: the fastest the line carries */
+
+/* needs <bio.h> for Biobuf and <thread.h> for Channel */
+
+/* Ephstats.errs[][] indices */
+enum {
+	ST_CRC,
+	ST_TIMEOUT,
+	ST_RETRY,
+	ST_NERR,
+};
+#define ST_NCMD	6	/* the five eph commands, and the init handshake */
+
+typedef struct Ephstats Ephstats;
+struct Ephstats {
+	ulong pktsin;
+	ulong pktsout;
+	uvlong bytesin;
+	uvlong bytesout;
+	ulong naks;		/* NAKs we sent */
+	ulong backoffs;		/* times the write delays were raised */
+	ulong errs[ST_NCMD][ST_NERR];
+	vlong sleepns;		/* time spent in inter-write delays */
+	vlong xstart;		/* nsec() when the current getvar began, 0 if none */
+	vlong xbytes;		/* bytes received by it so far */
+	vlong lastbytes;	/* the last complete getvar */
+	vlong lastns;
+	ulong speedups;		/* automatic speed changes */
+	ulong speeddowns;
+	ulong resyncs;		/* garbled packets the line was drained after */
+	uvlong discarded;	/* bytes drained */
+	vlong resyncns;		/* time spent draining */
+	ulong nrecov;		/* garbled packets followed by a good one */
+	vlong recovns;		/* time from the garbling to the good packet */
+	vlong errat;		/* nsec() of a garbling not yet recovered from */
+};
+
+/*
+ * Camio.trace: one entry per frame or byte that crossed the line,
+ * kept whatever the debug level, the oldest overwritten
+ */
+typedef struct Ephtrace Ephtrace;
+struct Ephtrace {
+	vlong ns;		/* nsec() when it finished */
+	uchar dir;		/* '>' sent, '<' received, '~' drained by a resync */
+	uchar typ;		/* packet type, or the byte itself */
+	uchar seq;
+	uchar cmd;		/* Camio.cmd at the time */
+	ushort len;		/* payload, or bytes drained */
+	short rc;		/* 0 or what the read or write came to */
+};
+#define EPH_NTRACE	512
+
+/*
+ * eph_record's file: EPH_RECMAGIC, then for each read or write
+ * on the line an EPH_RECHDR byte header, direction ('>' to the
+ * camera, '<' from it), length (2 bytes) and microseconds since
+ * the record before (4 bytes), little-endian, then the bytes.
+ */
+#define EPH_RECMAGIC	"ephrec 1\n"
+#define EPH_RECHDR	7
+
+/* Camio.delay[]: microseconds to wait before each write */
+enum {
+	DL_PKT,		/* a packet's type byte */
+	DL_CMD,		/* its sequence and length */
+	DL_PRM,		/* its payload and crc */
+	DL_BYTE,	/* an init, ACK or NAK byte */
+	DL_N,
+};
+
+#define EPH_RBUFSIZE	4096
 
 #define	eph_iob	Camio
 typedef struct eph_iob {
@@ -35,6 +107,37 @@ typedef struct eph_iob {
 	int fd;
 	int cfd;
 	unsigned long timeout;
+	int cmd;		/* what the errors are charged to */
+	long delay[DL_N];
+	int clean;		/* exchanges since the delays last changed */
+	long speed;		/* of the line now */
+	int autospeed;		/* follow what the line carries */
+	long maxspeed;		/* the fastest that passed the line test */
+	long speedcap;		/* auto: probe no faster than this; 0 for no limit */
+	ulong tpkts;		/* packets and errors when the speed was last looked at */
+	ulong terrs;
+	unsigned char rbuf[EPH_RBUFSIZE];	/* received, not yet consumed: rbuf[rp..re) */
+	int rp;
+	int re;
+
+	/* input comes from a reader proc; deadlines from a timer proc */
+	Channel *rdc;		/* Rblock* from the reader */
+	Channel *tset;		/* deadlines to the timer */
+	Channel *tfire;		/* generation numbers of expired deadlines */
+	Channel *exitc;		/* the two procs saying they are gone */
+	ulong tgen;
+	int rtid;
+	int rerr;		/* the reader has stopped */
+	int stop;		/* hangup wants the reader gone */
+	unsigned char ibuf[EPH_RBUFSIZE];	/* the reader's */
+	Ephstats stats;
+	Ephtrace trace[EPH_NTRACE];
+	ulong ntrace;		/* entries ever made; trace[ntrace%EPH_NTRACE] is next */
+	ulong tdumped;		/* ntrace at the last dump */
+	int tracedump;		/* on an error print up to this many entries not yet printed */
+	Biobuf *rec;		/* where the line's traffic is recorded, if anywhere */
+	QLock reclk;		/* the reader proc records too; held across Bwrite */
+	vlong recns;		/* nsec() of the last record */
 } eph_iob;
 
 eph_iob *eph_new(void (*errorcb)(int errcode,char *errstr),
@@ -50,6 +153,15 @@ int eph_getint(eph_iob *iob,int reg,long *val);
 int eph_action(eph_iob *iob,int reg,char *val,size_t length);
 int eph_setvar(eph_iob *iob,int reg,char *val,off_t length);
 int eph_getvar(eph_iob *iob,int reg,char **val,off_t *length);
+int eph_getvarbuf(eph_iob *iob,int reg,char *val,off_t length);
+char *eph_fmtstats(eph_iob *iob,char *p,char *e);
+char *eph_fmttrace(eph_iob *iob,char *p,char *e,int n);
+int eph_record(eph_iob *iob,int fd);
+int eph_calibrate(eph_iob *iob);
+int eph_setspeed(eph_iob *iob,long speed);
+int eph_validspeed(long speed);
+int eph_tune(eph_iob *iob);
+int eph_stepdown(eph_iob *iob);
 
 #define ERR_BASE		10001
 #define ERR_DATA_TOO_LONG	10001
@@ -61,7 +173,8 @@ int eph_getvar(eph_iob *iob,int reg,char **val,off_t *length);
 #define ERR_NOMEM		10007
 #define ERR_BADARGS		10008
 #define ERR_EXCESSIVE_RETRY	10009
-#define ERR_MAX			10010
+#define ERR_BADSIZE		10010
+#define ERR_MAX			10011
 
 #define REG_FRAME		4
 #define REG_SPEED		17
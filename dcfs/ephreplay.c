@@ -0,0 +1,141 @@
+/*
+ * ephreplay: play back the camera's side of a session
+ * recorded with dcfs -r, on a pipe posted in /srv (or on
+ * standard input and output), so the same transfer can be
+ * run again and timed against a changed eph.c.
+ *
+ *	dcfs -r sess.rec -l /dev/eia0 ...	# with the camera
+ *	ephreplay -s ephreplay sess.rec
+ *	dcfs -l /srv/ephreplay -m /n/dc	# and the same reads
+ *
+ * what the host sent is read back and compared, byte for
+ * byte; each thing the camera sent goes out as long after
+ * the record before it as it did then, times -t (0 sends
+ * everything as soon as the host has asked for it).  the
+ * host has to make the same requests in the same order:
+ * once it strays the replay is out of step, and it says
+ * how many of the host's records came out different.
+ */
+
+#include <u.h>
+#include <libc.h>
+#include <bio.h>
+
+/* ephsrv.c */
+extern int infd;
+extern int outfd;
+void camsrv(char*);
+void xmit(uchar*, int);
+
+enum {
+	RECHDR = 7,		/* see eph_io.h */
+	MAXREC = 65535,
+};
+
+static char recmagic[] = "ephrec 1\n";
+
+static int debug;
+static double scale = 1.0;	/* -t: multiplies the recorded gaps */
+
+static void
+replay(Biobuf *b)
+{
+	uchar h[RECHDR], *rec, *got;
+	vlong at, now, t0, hostbytes;
+	uvlong dt;
+	long nrec, ndiff;
+	int n;
+
+	rec = malloc(MAXREC);
+	got = malloc(MAXREC);
+	if (rec == nil || got == nil)
+		sysfatal("malloc: %r");
+	nrec = ndiff = 0;
+	hostbytes = 0;
+	t0 = at = nsec();
+	while (Bread(b, h, RECHDR) == RECHDR) {
+		n = h[1] | h[2]<<8;
+		dt = h[3] | h[4]<<8 | h[5]<<16 | (uvlong)h[6]<<24;
+		if (Bread(b, rec, n) != n)
+			sysfatal("record %ld: short", nrec);
+		nrec++;
+		switch (h[0]) {
+		case '>':
+			if (readn(infd, got, n) != n) {
+				fprint(2, "ephreplay: host gone at record %ld\n", nrec);
+				goto out;
+			}
+			if (memcmp(got, rec, n) != 0) {
+				ndiff++;
+				if (debug)
+					fprint(2, "record %ld: host sent %.2ux..., recorded %.2ux...\n",
+						nrec, got[0], rec[0]);
+			}
+			hostbytes += n;
+			at = nsec();
+			break;
+		case '<':
+			at += dt*scale*1000;
+			now = nsec();
+			if (at-now >= 1000000)
+				sleep((at-now)/1000000);
+			else if (at < now)
+				at = now;	/* the host was slow; don't catch up */
+			xmit(rec, n);
+			if (debug)
+				fprint(2, "> %d bytes after %lludµs\n", n, dt);
+			break;
+		default:
+			sysfatal("record %ld: bad direction %#.2ux", nrec, h[0]);
+		}
+	}
+out:
+	fprint(2, "ephreplay: %ld records, %lld bytes from the host, %ld differed, %.3f s\n",
+		nrec, hostbytes, ndiff, (nsec()-t0)/1e9);
+	free(rec);
+	free(got);
+}
+
+static void
+usage(void)
+{
+	fprint(2, "usage: ephreplay [-D] [-s srvname] [-t scale] recfile\n");
+	exits("usage");
+}
+
+void
+main(int argc, char **argv)
+{
+	char *srvname, magic[sizeof recmagic-1];
+	Biobuf *b;
+
+	srvname = nil;
+	ARGBEGIN{
+	case 'D':
+		debug++;
+		break;
+	case 's':
+		srvname = EARGF(usage());
+		break;
+	case 't':
+		scale = atof(EARGF(usage()));
+		if (scale < 0)
+			usage();
+		break;
+	default:
+		usage();
+	}ARGEND
+	if (argc != 1)
+		usage();
+
+	if ((b = Bopen(argv[0], OREAD)) == nil)
+		sysfatal("%s: %r", argv[0]);
+	if (Bread(b, magic, sizeof magic) != sizeof magic ||
+	    memcmp(magic, recmagic, sizeof magic) != 0)
+		sysfatal("%s: not a recording", argv[0]);
+
+	camsrv(srvname);
+	replay(b);
+	Bterm(b);
+	exits(nil);
+}
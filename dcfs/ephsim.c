@@ -0,0 +1,536 @@
+/*
+ * ephsim: the camera end of the PhotoPC protocol that eph.c
+ * speaks, served on a pipe posted in /srv (or on standard
+ * input and output), so dcfs can be run and timed without a
+ * camera on a serial port.
+ *
+ *	ephsim -s ephsim -n 20 -z 400000
+ *	dcfs -l /srv/ephsim -m /n/dc
+ *
+ * it handles the init handshake, speed changes through reg 17,
+ * setint/getint/action/setvar/getvar with the usual framing,
+ * additive crc and ACK/NAK, and registers 1, 4, 10, 12, 13, 14,
+ * 15 and 47.  bytes it sends are paced to the current simulated
+ * line speed.  -e n garbles about one byte in n that it sends,
+ * flipping a bit or putting a burst of rubbish in front of it,
+ * to see how the host gets back in step; -q b keeps the line
+ * clean at b and below, as a cable that fails only when pushed.
+ */
+
+#include <u.h>
+#include <libc.h>
+
+/* ephsrv.c */
+extern int infd;
+extern int outfd;
+void camsrv(char*);
+void xmit(uchar*, int);
+
+enum {
+	/* protocol characters */
+	ACK = 0x06,
+	NAK = 0x15,
+	SIG = 0x15,
+	DONE = 0x05,	/* action complete */
+
+	/* commands */
+	CMD_SETINT = 0,
+	CMD_GETINT = 1,
+	CMD_ACTION = 2,
+	CMD_SETVAR = 3,
+	CMD_GETVAR = 4,
+
+	/* packet types */
+	PKT_CMD = 0x1B,
+	PKT_DATA = 0x02,
+	PKT_LAST = 0x03,
+
+	EPHBSIZE = 2048,
+	DEFBAUD = 19200,
+};
+
+typedef struct Image Image;
+struct Image {
+	uchar *data;
+	long len;
+	uchar *tmn;
+	long tmnlen;
+	long mtime;
+};
+
+static Image *img;
+static int nimg;
+static long size = 300*1024;	/* -z: made-up images, and snapshots */
+static long frame = 1;		/* reg 4 */
+static long baud = DEFBAUD;
+static long speeds[] = { DEFBAUD, 9600, 19200, 38400, 57600, 115200 };
+static int debug;
+static vlong linefree;		/* when the simulated line has sent what we wrote */
+static long erate;		/* garble one byte in erate; 0 for a clean line */
+static long cleanbaud;		/* -q: no garbling at this speed or slower */
+static long nerrs;
+
+static uchar ibuf[8192];
+static int ip, ie;
+
+static int
+getb(void)
+{
+	if (ip == ie) {
+		ie = read(infd, ibuf, sizeof ibuf);
+		ip = 0;
+		if (ie <= 0) {
+			ie = 0;
+			return -1;
+		}
+	}
+	return ibuf[ip++];
+}
+
+static void
+ungetb(void)
+{
+	ip--;
+}
+
+/* line noise: a flipped bit, or a few bytes of rubbish before p[i] */
+static void
+noisy(uchar *p, int n)
+{
+	uchar junk[8], c;
+	int i, j, k;
+
+	j = 0;
+	for (i = 0; i < n; i++) {
+		if (nrand(erate) != 0)
+			continue;
+		nerrs++;
+		if (nrand(2)) {
+			c = p[i] ^ 1<<nrand(8);
+			xmit(p+j, i-j);
+			xmit(&c, 1);
+			j = i+1;
+		} else {
+			xmit(p+j, i-j);
+			k = 1+nrand(sizeof junk);
+			for (c = 0; c < k; c++)
+				junk[c] = nrand(256);
+			xmit(junk, k);
+			j = i;
+		}
+		if (debug)
+			fprint(2, "noise %ld\n", nerrs);
+	}
+	xmit(p+j, n-j);
+}
+
+/* write n bytes, no faster than the line would carry them */
+static void
+put(uchar *p, int n)
+{
+	vlong now, t;
+
+	now = nsec();
+	if (linefree < now)
+		linefree = now;
+	linefree += (vlong)n*10*1000000000LL/baud;
+	t = linefree-now;
+	if (t >= 1000000)
+		sleep(t/1000000);
+	if (erate > 0 && baud > cleanbaud)
+		noisy(p, n);
+	else
+		xmit(p, n);
+	if (debug)
+		fprint(2, "> %d bytes\n", n);
+}
+
+static void
+putb(int c)
+{
+	uchar b;
+
+	b = c;
+	put(&b, 1);
+}
+
+static void
+sendpkt(int typ, int seq, uchar *data, int len)
+{
+	uchar buf[EPHBSIZE+6];
+	ushort crc;
+	int i;
+
+	buf[0] = typ;
+	buf[1] = seq;
+	buf[2] = len&0xff;
+	buf[3] = len>>8;
+	crc = 0;
+	for (i = 0; i < len; i++) {
+		crc += data[i];
+		buf[4+i] = data[i];
+	}
+	buf[4+len] = crc&0xff;
+	buf[5+len] = crc>>8;
+	put(buf, len+6);
+}
+
+/*
+ * send a value as numbered packets, each one resent
+ * until the host ACKs it.  returns 0 if the host went
+ * on to something else.
+ */
+static int
+sendvar(uchar *data, long len)
+{
+	int seq, n, c;
+	long off;
+
+	seq = 0;
+	off = 0;
+	do {
+		n = len-off;
+		if (n > EPHBSIZE)
+			n = EPHBSIZE;
+	again:
+		sendpkt(off+n >= len? PKT_LAST: PKT_DATA, seq, data+off, n);
+		switch (c = getb()) {
+		case ACK:
+			break;
+		case NAK:
+			if (debug) fprint(2, "NAK for seq %d\n", seq);
+			goto again;
+		default:
+			if (c >= 0)
+				ungetb();
+			return 0;
+		}
+		off += n;
+		seq++;
+	} while (off < len);
+	return 1;
+}
+
+/* read the rest of a packet whose type byte has been read */
+static int
+getpkt(uchar *data, int *lenp)
+{
+	int i, c, seq, len;
+	ushort crc, rcrc;
+
+	if ((seq = getb()) < 0)
+		return -1;
+	if ((c = getb()) < 0)
+		return -1;
+	len = c;
+	if ((c = getb()) < 0)
+		return -1;
+	len |= c<<8;
+	if (len > EPHBSIZE)
+		return -2;
+	crc = 0;
+	for (i = 0; i < len; i++) {
+		if ((c = getb()) < 0)
+			return -1;
+		data[i] = c;
+		crc += c;
+	}
+	if ((c = getb()) < 0)
+		return -1;
+	rcrc = c;
+	if ((c = getb()) < 0)
+		return -1;
+	rcrc |= c<<8;
+	if (crc != rcrc)
+		return -2;
+	*lenp = len;
+	USED(seq);
+	return 0;
+}
+
+static Image*
+cur(void)
+{
+	if (frame < 1 || frame > nimg)
+		return nil;
+	return &img[frame-1];
+}
+
+static long
+getreg(int reg)
+{
+	Image *im;
+
+	im = cur();
+	switch (reg) {
+	case 1:
+		return 0x0101;	/* anything non-failing will do for a probe */
+	case 4:
+		return frame;
+	case 10:
+		return nimg;
+	case 12:
+		return im? im->len: 0;
+	case 13:
+		return im? im->tmnlen: 0;
+	}
+	return 0;
+}
+
+static void
+getvar(int reg)
+{
+	uchar info[32];
+	Image *im;
+
+	im = cur();
+	switch (reg) {
+	case 14:
+		if (im != nil) {
+			sendvar(im->data, im->len);
+			return;
+		}
+		break;
+	case 15:
+		if (im != nil) {
+			sendvar(im->tmn, im->tmnlen);
+			return;
+		}
+		break;
+	case 47:
+		memset(info, 0, sizeof info);
+		if (im != nil) {
+			info[20] = im->mtime;
+			info[21] = im->mtime>>8;
+			info[22] = im->mtime>>16;
+			info[23] = im->mtime>>24;
+		}
+		sendvar(info, sizeof info);
+		return;
+	}
+	sendvar(info, 0);
+}
+
+static void mkimage(Image*, long, long, int);
+
+static void
+action(int reg, uchar *arg, int len)
+{
+	putb(ACK);
+	switch (reg) {
+	case 2:		/* snapshot */
+		sleep(500);
+		img = realloc(img, (nimg+1)*sizeof img[0]);
+		if (img == nil)
+			sysfatal("realloc: %r");
+		mkimage(&img[nimg], size, time(0), nimg+1);
+		nimg++;
+		break;
+	case 4:		/* power off */
+		if (len > 0 && arg[0] == 0)
+			baud = DEFBAUD;
+		break;
+	}
+	putb(DONE);
+}
+
+static void
+command(uchar *pkt, int len)
+{
+	long val;
+	int reg, c;
+	uchar v[4];
+
+	if (len < 2) {
+		putb(NAK);
+		return;
+	}
+	reg = pkt[1];
+	if (debug) fprint(2, "cmd %d reg %d\n", pkt[0], reg);
+	switch (pkt[0]) {
+	case CMD_SETINT:
+		if (len < 6) {
+			putb(NAK);
+			return;
+		}
+		val = pkt[2] | pkt[3]<<8 | pkt[4]<<16 | pkt[5]<<24;
+		putb(ACK);
+		if (reg == 4)
+			frame = val;
+		else if (reg == 17 && val >= 0 && val < nelem(speeds)) {
+			baud = speeds[val];
+			if (debug) fprint(2, "speed %ld\n", baud);
+		}
+		break;
+	case CMD_GETINT:
+		val = getreg(reg);
+		v[0] = val;
+		v[1] = val>>8;
+		v[2] = val>>16;
+		v[3] = val>>24;
+		for (;;) {
+			sendpkt(PKT_LAST, 0, v, 4);
+			if ((c = getb()) != NAK)
+				break;
+		}
+		if (c >= 0 && c != ACK)
+			ungetb();
+		break;
+	case CMD_ACTION:
+		action(reg, pkt+2, len-2);
+		break;
+	case CMD_SETVAR:
+		putb(ACK);	/* the data packets are ACKed by serve */
+		break;
+	case CMD_GETVAR:
+		getvar(reg);
+		break;
+	default:
+		putb(NAK);
+	}
+}
+
+static void
+serve(void)
+{
+	uchar pkt[EPHBSIZE];
+	int c, len;
+
+	for (;;) {
+		switch (c = getb()) {
+		case -1:
+			return;
+		case 0:		/* init */
+			baud = DEFBAUD;
+			putb(SIG);
+			break;
+		case PKT_CMD:
+		case PKT_DATA:
+		case PKT_LAST:
+			switch (getpkt(pkt, &len)) {
+			case -1:
+				return;
+			case -2:
+				putb(NAK);
+				break;
+			default:
+				if (c == PKT_CMD)
+					command(pkt, len);
+				else
+					putb(ACK);
+			}
+			break;
+		default:
+			if (debug) fprint(2, "stray 0x%.2x\n", c);
+		}
+	}
+}
+
+/* a thumbnail is every 16th byte of the image */
+static void
+mktmn(Image *im)
+{
+	long i;
+
+	for (i = 0; i < im->tmnlen; i++)
+		im->tmn[i] = im->data[i*16 % im->len];
+	im->tmn[0] = 0xFF;
+	im->tmn[1] = 0xD8;
+}
+
+/* something shaped like a jpeg, the same every run */
+static void
+mkimage(Image *im, long len, long mtime, int seed)
+{
+	long i;
+	ulong x;
+
+	im->len = len;
+	im->data = malloc(len);
+	im->tmnlen = len/16 < 64? 64: len/16;
+	im->tmn = malloc(im->tmnlen);
+	if (im->data == nil || im->tmn == nil)
+		sysfatal("malloc: %r");
+	x = seed*2654435761UL;
+	for (i = 0; i < len; i++) {
+		x = x*1103515245 + 12345;
+		im->data[i] = x>>16;
+	}
+	im->data[0] = 0xFF;
+	im->data[1] = 0xD8;
+	mktmn(im);
+	im->mtime = mtime;
+}
+
+static void
+loadimage(Image *im, char *file, int seed)
+{
+	Dir *d;
+	int fd;
+
+	if ((fd = open(file, OREAD)) < 0 || (d = dirfstat(fd)) == nil)
+		sysfatal("%s: %r", file);
+	if (d->length < 2)
+		sysfatal("%s: too short", file);
+	mkimage(im, d->length, d->mtime, seed);
+	if (readn(fd, im->data, im->len) != im->len)
+		sysfatal("reading %s: %r", file);
+	mktmn(im);
+	free(d);
+	close(fd);
+}
+
+static void
+usage(void)
+{
+	fprint(2, "usage: ephsim [-D] [-e errrate] [-q cleanbaud] [-s srvname] [-n nimages] [-z size] [file ...]\n");
+	exits("usage");
+}
+
+void
+main(int argc, char **argv)
+{
+	char *srvname;
+	int i, n;
+
+	srvname = nil;
+	n = 10;
+	ARGBEGIN{
+	case 'D':
+		debug++;
+		break;
+	case 's':
+		srvname = EARGF(usage());
+		break;
+	case 'n':
+		n = atoi(EARGF(usage()));
+		break;
+	case 'z':
+		size = atol(EARGF(usage()));
+		break;
+	case 'e':
+		erate = atol(EARGF(usage()));
+		break;
+	case 'q':
+		cleanbaud = atol(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if (argc > 0) {
+		nimg = argc;
+		img = malloc(nimg*sizeof img[0]);
+		for (i = 0; i < argc; i++)
+			loadimage(&img[i], argv[i], i+1);
+	} else {
+		nimg = n;
+		img = malloc(nimg*sizeof img[0]);
+		for (i = 0; i < n; i++)
+			mkimage(&img[i], size - i*size/(4*n), time(0) - (n-i)*60, i+1);
+	}
+
+	camsrv(srvname);
+	serve();
+	exits(nil);
+}
@@ -0,0 +1,56 @@
+/*
+ * what ephsim and ephreplay share: standing in for the camera
+ * on a pipe posted in /srv, or on standard input and output.
+ */
+
+#include <u.h>
+#include <libc.h>
+
+int infd = 0;
+int outfd = 1;
+
+/* a host that has gone shows up as a write error, not a dead proc */
+static int
+pipenote(void*, char *msg)
+{
+	return strcmp(msg, "sys: write on closed pipe") == 0;
+}
+
+/*
+ * with srvname, post one end of a pipe as /srv/srvname, leave
+ * a child to serve the other and return in it; the parent exits.
+ */
+void
+camsrv(char *srvname)
+{
+	char *s;
+	int fd, p[2];
+
+	atnotify(pipenote, 1);
+	if (srvname == nil)
+		return;
+	if (pipe(p) < 0)
+		sysfatal("pipe: %r");
+	s = smprint("/srv/%s", srvname);
+	if ((fd = create(s, OWRITE|ORCLOSE, 0600)) < 0)
+		sysfatal("create %s: %r", s);
+	if (fprint(fd, "%d", p[0]) < 0)
+		sysfatal("post %s: %r", s);
+	close(p[0]);
+	infd = outfd = p[1];
+	switch (rfork(RFPROC|RFFDG|RFNOWAIT)) {
+	case -1:
+		sysfatal("fork: %r");
+	case 0:
+		break;
+	default:
+		exits(nil);
+	}
+}
+
+void
+xmit(uchar *p, int n)
+{
+	if (write(outfd, p, n) != n)
+		sysfatal("write: %r");
+}